@@ -0,0 +1,1028 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/stat.h>
+
+#include "../git2pp.h"
+#include "synth.h"
+
+// Measures each git2pp wrapper path against the equivalent raw libgit2 calls.
+// Every case is timed as a raw/wrapped pair over the same synthetic repository.
+
+namespace {
+
+    template <typename T>
+    inline void keep(T const & t) {
+        asm volatile("" : : "g"(&t) : "memory");
+    }
+
+    struct OidHash {
+        size_t operator()(git_oid const & oid) const {
+            return std::hash<std::string_view>{}({reinterpret_cast<char const *>(oid.id), sizeof(oid.id)});
+        }
+    };
+
+    struct OidEqual {
+        bool operator()(git_oid const & a, git_oid const & b) const { return git_oid_equal(&a, &b); }
+    };
+
+    struct Options {
+        synth::Spec spec;
+        double minTime = 0.2;   // Seconds per measurement round.
+        double maxRatio = 0;    // Fail if wrapped/raw exceeds this (0 = never).
+        char const * filter = nullptr;
+        std::string allocator;  // malloc, pool or arena; empty = libgit2's own.
+        std::string tuning;     // server, cli or low-memory; empty = defaults.
+    };
+
+    class Bench {
+    public:
+        explicit Bench(Options const & opts) : opts_{opts} {
+            std::cout << std::left << std::setw(44) << "case"
+                      << std::right << std::setw(12) << "raw ns/op"
+                      << std::setw(14) << "git2pp ns/op"
+                      << std::setw(9) << "ratio" << "\n";
+        }
+
+        template <typename Raw, typename Wrapped>
+        void compare(char const * name, Raw && raw, Wrapped && wrapped) {
+            if (opts_.filter && !std::strstr(name, opts_.filter)) {
+                return;
+            }
+            double r = measure(raw);
+            double w = measure(wrapped);
+            double ratio = w / r;
+            bool bad = opts_.maxRatio > 0 && ratio > opts_.maxRatio;
+            failed_ |= bad;
+            std::cout << std::left << std::setw(44) << name << std::right << std::fixed
+                      << std::setprecision(1) << std::setw(12) << r << std::setw(14) << w
+                      << std::setprecision(3) << std::setw(9) << ratio << (bad ? "  REGRESSION" : "") << "\n";
+        }
+
+        // Reports a correctness check that a case depends on.
+        void expect(char const * name, bool ok) {
+            if (opts_.filter && !std::strstr(name, opts_.filter)) {
+                return;
+            }
+            failed_ |= !ok;
+            std::cout << std::left << std::setw(44) << name << (ok ? "  ok" : "  FAILED") << "\n";
+        }
+
+        bool failed() const { return failed_; }
+
+    private:
+        Options opts_;
+        bool failed_ = false;
+
+        // Best of three rounds, each running for at least minTime seconds.
+        template <typename F>
+        double measure(F & f) {
+            using clock = std::chrono::steady_clock;
+            double best = 1e300;
+            for (int round = 0; round < 3; ++round) {
+                size_t n = 0;
+                size_t batch = 1;
+                auto start = clock::now();
+                std::chrono::duration<double> elapsed{};
+                do {
+                    for (size_t i = 0; i < batch; ++i) {
+                        f();
+                    }
+                    n += batch;
+                    batch *= 2;
+                    elapsed = clock::now() - start;
+                } while (elapsed.count() < opts_.minTime);
+                best = std::min(best, elapsed.count() * 1e9 / n);
+            }
+            return best;
+        }
+    };
+
+    void run(Bench & b, char const * path) {
+        git2pp::Session git2;
+
+        git_repository * rawRepo;
+        git2pp::check(git_repository_open_ext(&rawRepo, path, 0, nullptr));
+        git2pp::UniquePtr<git_repository> repo{rawRepo};
+
+        git_oid head;
+        git2pp::check(git_reference_name_to_id(&head, rawRepo, "HEAD"));
+        auto headCommit = repo[git_commit_lookup](&head);
+
+        // Session::operator[]
+
+        b.compare("Session[git_signature_new]",
+            [&] {
+                git_signature * sig;
+                git2pp::check(git_signature_new(&sig, "a", "b", 0, 0));
+                keep(sig);
+                git_signature_free(sig);
+            },
+            [&] {
+                auto sig = git2[git_signature_new]("a", "b", 0, 0);
+                keep(sig);
+            });
+
+        b.compare("Session[git_repository_open_ext]",
+            [&] {
+                git_repository * r;
+                git2pp::check(git_repository_open_ext(&r, path, 0, nullptr));
+                git_repository_free(r);
+            },
+            [&] {
+                auto r = git2[git_repository_open_ext](path, 0, nullptr);
+                keep(r);
+            });
+
+        git2pp::RepositoryPool pool{git2, path, 4};
+        b.compare("RepositoryPool::lease vs open",
+            [&] {
+                git_repository * r;
+                git2pp::check(git_repository_open_ext(&r, path, 0, nullptr));
+                git_repository_free(r);
+            },
+            [&] {
+                auto r = pool.lease();
+                keep(r);
+            });
+
+        // UniquePtr::operator[], one case per overload.
+
+        b.compare("UniquePtr[U**, T*] git_reference_dwim",
+            [&] {
+                git_reference * ref;
+                git2pp::check(git_reference_dwim(&ref, rawRepo, "main"));
+                git_reference_free(ref);
+            },
+            [&] {
+                auto ref = repo[git_reference_dwim]("main");
+                keep(ref);
+            });
+
+        b.compare("UniquePtr[U**, T const*] git_commit_parent",
+            [&] {
+                git_commit * p;
+                git2pp::check(git_commit_parent(&p, &*headCommit, 0));
+                git_commit_free(p);
+            },
+            [&] {
+                auto p = headCommit[git_commit_parent](0);
+                keep(p);
+            });
+
+        b.compare("UniquePtr[git_oid*] git_reference_name_to_id",
+            [&] {
+                git_oid oid;
+                git2pp::check(git_reference_name_to_id(&oid, rawRepo, "HEAD"));
+                keep(oid);
+            },
+            [&] {
+                auto oid = repo[git_reference_name_to_id]("HEAD");
+                keep(oid);
+            });
+
+        b.compare("UniquePtr[T*] git_commit_summary",
+            [&] { keep(git_commit_summary(&*headCommit)); },
+            [&] { keep(headCommit[git_commit_summary]()); });
+
+        b.compare("UniquePtr[T const*] git_commit_parent_id",
+            [&] { keep(git_commit_parent_id(&*headCommit, 0)); },
+            [&] { keep(headCommit[git_commit_parent_id](0)); });
+
+        // Expected failures: exception path versus try_().
+
+        b.compare("UniquePtr[] ENOTFOUND (throws)",
+            [&] {
+                git_reference * ref;
+                if (git_reference_dwim(&ref, rawRepo, "no-such-ref") == 0) {
+                    git_reference_free(ref);
+                }
+            },
+            [&] {
+                try {
+                    auto ref = repo[git_reference_dwim]("no-such-ref");
+                    keep(ref);
+                } catch (git2pp::Error const & e) {
+                    keep(e);
+                }
+            });
+
+        b.compare("UniquePtr::try_() ENOTFOUND",
+            [&] {
+                git_reference * ref;
+                if (git_reference_dwim(&ref, rawRepo, "no-such-ref") == 0) {
+                    git_reference_free(ref);
+                }
+            },
+            [&] {
+                auto ref = repo.try_()[git_reference_dwim]("no-such-ref");
+                keep(ref);
+            });
+
+        // detail::wrap/wrapOid invoked directly.
+
+        b.compare("detail::wrap git_commit_lookup",
+            [&] {
+                git_commit * c;
+                git2pp::check(git_commit_lookup(&c, rawRepo, &head));
+                git_commit_free(c);
+            },
+            [&] {
+                auto c = git2pp::detail::wrap(git_commit_lookup, rawRepo, &head);
+                keep(c);
+            });
+
+        b.compare("detail::wrapOid git_reference_name_to_id",
+            [&] {
+                git_oid oid;
+                git2pp::check(git_reference_name_to_id(&oid, rawRepo, "HEAD"));
+                keep(oid);
+            },
+            [&] {
+                auto oid = git2pp::detail::wrapOid(git_reference_name_to_id, rawRepo, "HEAD");
+                keep(oid);
+            });
+
+        // Copy construction through obj_dup.
+
+        b.compare("UniquePtr(const&) git_commit (object_dup)",
+            [&] {
+                git_object * c;
+                git2pp::check(git_object_dup(&c, (git_object *)&*headCommit));
+                git_object_free(c);
+            },
+            [&] {
+                git2pp::UniquePtr<git_commit> c{headCommit};
+                keep(c);
+            });
+
+        auto sig = git2[git_signature_new]("a", "b", 0, 0);
+        b.compare("UniquePtr(const&) git_signature",
+            [&] {
+                git_signature * s;
+                git2pp::check(git_signature_dup(&s, &*sig));
+                git_signature_free(s);
+            },
+            [&] {
+                git2pp::UniquePtr<git_signature> s{sig};
+                keep(s);
+            });
+
+        // Iterables. Each case drains a complete iteration.
+
+        b.compare("RevwalkIterable",
+            [&] {
+                git_revwalk * walk;
+                git2pp::check(git_revwalk_new(&walk, rawRepo));
+                git2pp::check(git_revwalk_push(walk, &head));
+                git_oid oid;
+                int rc;
+                while ((rc = git_revwalk_next(&oid, walk)) == 0) {
+                    keep(oid);
+                }
+                if (rc != GIT_ITEROVER) {
+                    git2pp::check(rc);
+                }
+                git_revwalk_free(walk);
+            },
+            [&] {
+                auto walk = repo[git_revwalk_new]();
+                git2pp::check(walk[git_revwalk_push](&head));
+                for (auto && oid : walk) {
+                    keep(oid);
+                }
+            });
+
+        b.compare("ReferenceIterable",
+            [&] {
+                git_reference_iterator * it;
+                git2pp::check(git_reference_iterator_new(&it, rawRepo));
+                git_reference * ref;
+                while (git_reference_next(&ref, it) == 0) {
+                    keep(ref);
+                    git_reference_free(ref);
+                }
+                git_reference_iterator_free(it);
+            },
+            [&] {
+                for (auto && ref : repo[git_reference_iterator_new]()) {
+                    keep(ref);
+                }
+            });
+
+        b.compare("BranchIterable",
+            [&] {
+                git_branch_iterator * it;
+                git2pp::check(git_branch_iterator_new(&it, rawRepo, GIT_BRANCH_ALL));
+                git_reference * ref;
+                git_branch_t type;
+                while (git_branch_next(&ref, &type, it) == 0) {
+                    keep(ref);
+                    git_reference_free(ref);
+                }
+                git_branch_iterator_free(it);
+            },
+            [&] {
+                for (auto && branch : repo[git_branch_iterator_new](GIT_BRANCH_ALL)) {
+                    keep(branch);
+                }
+            });
+
+        auto config = repo[git_repository_config]();
+        b.compare("ConfigIterable",
+            [&] {
+                git_config_iterator * it;
+                git2pp::check(git_config_iterator_new(&it, &*config));
+                git_config_entry * entry;
+                while (git_config_next(&entry, it) == 0) {
+                    keep(entry);
+                }
+                git_config_iterator_free(it);
+            },
+            [&] {
+                for (auto && entry : config[git_config_iterator_new]()) {
+                    keep(entry);
+                }
+            });
+
+        auto index = repo[git_repository_index]();
+#if LIBGIT2PP_HAVE_INDEX_ITERATOR
+        b.compare("IndexIteratorIterable",
+            [&] {
+                git_index_iterator * it;
+                git2pp::check(git_index_iterator_new(&it, &*index));
+                git_index_entry const * entry;
+                while (git_index_iterator_next(&entry, it) == 0) {
+                    keep(entry);
+                }
+                git_index_iterator_free(it);
+            },
+            [&] {
+                for (auto && entry : index[git_index_iterator_new]()) {
+                    keep(entry);
+                }
+            });
+#endif
+
+        b.compare("IndexConflictIterable",
+            [&] {
+                git_index_conflict_iterator * it;
+                git2pp::check(git_index_conflict_iterator_new(&it, &*index));
+                git_index_entry const * a, * o, * t;
+                while (git_index_conflict_next(&a, &o, &t, it) == 0) {
+                    keep(a);
+                }
+                git_index_conflict_iterator_free(it);
+            },
+            [&] {
+                for (auto && conflict : index[git_index_conflict_iterator_new]()) {
+                    keep(conflict);
+                }
+            });
+
+        b.compare("NoteIterable",
+            [&] {
+                git_note_iterator * it;
+                git2pp::check(git_note_iterator_new(&it, rawRepo, "refs/notes/commits"));
+                git_oid note, annotated;
+                while (git_note_next(&note, &annotated, it) == 0) {
+                    keep(note);
+                }
+                git_note_iterator_free(it);
+            },
+            [&] {
+                for (auto && note : repo[git_note_iterator_new]("refs/notes/commits")) {
+                    keep(note);
+                }
+            });
+
+        git_rebase_options rebaseOpts;
+        git2pp::check(git_rebase_options_init(&rebaseOpts, GIT_REBASE_OPTIONS_VERSION));
+        rebaseOpts.inmemory = 1;
+        auto topicRef = repo[git_reference_lookup]("refs/heads/topic");
+        auto mainRef = repo[git_reference_lookup]("refs/heads/main");
+        auto topic = repo[git_annotated_commit_from_ref](&*topicRef);
+        auto upstream = repo[git_annotated_commit_from_ref](&*mainRef);
+        b.compare("RebaseIterable (in-memory)",
+            [&] {
+                git_rebase * rebase;
+                git2pp::check(git_rebase_init(&rebase, rawRepo, &*topic, &*upstream, nullptr, &rebaseOpts));
+                git_rebase_operation * op;
+                while (git_rebase_next(&op, rebase) == 0) {
+                    keep(op);
+                }
+                git_rebase_free(rebase);
+            },
+            [&] {
+                for (auto && op : repo[git_rebase_init](&*topic, &*upstream, nullptr, &rebaseOpts)) {
+                    keep(op);
+                }
+            });
+    }
+
+    // Baseline here is the standard library rather than raw libgit2.
+    void runContainers(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        std::vector<git_oid> oids;
+        auto walk = repo[git_revwalk_new]();
+        git2pp::check(walk[git_revwalk_push_head]());
+        for (auto && oid : walk) {
+            oids.push_back(oid);
+        }
+
+        b.compare("OidSet insert+lookup vs unordered_set",
+            [&] {
+                std::unordered_set<git_oid, OidHash, OidEqual> set;
+                for (auto & oid : oids) {
+                    set.insert(oid);
+                }
+                for (auto & oid : oids) {
+                    keep(set.count(oid));
+                }
+            },
+            [&] {
+                git2pp::OidSet set;
+                for (auto & oid : oids) {
+                    set.insert(oid);
+                }
+                for (auto & oid : oids) {
+                    keep(set.contains(oid));
+                }
+            });
+
+        b.compare("OidMap insert+lookup vs unordered_map",
+            [&] {
+                std::unordered_map<git_oid, size_t, OidHash, OidEqual> map;
+                for (size_t i = 0; i < oids.size(); ++i) {
+                    map[oids[i]] = i;
+                }
+                for (auto & oid : oids) {
+                    keep(map.find(oid)->second);
+                }
+            },
+            [&] {
+                git2pp::OidMap<size_t> map;
+                for (size_t i = 0; i < oids.size(); ++i) {
+                    map[oids[i]] = i;
+                }
+                for (auto & oid : oids) {
+                    keep(*map.find(oid));
+                }
+            });
+    }
+
+    void runGraph(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto walk = repo[git_revwalk_new]();
+        git2pp::check(walk[git_revwalk_push_glob]("refs/heads/*"));
+        auto graph = git2pp::CommitGraph::build(walk);
+
+        auto main = repo[git_reference_name_to_id]("refs/heads/main");
+        auto topic = repo[git_reference_name_to_id]("refs/heads/topic");
+        b.compare("CommitGraph merge base vs git_merge_base",
+            [&] { keep(repo[git_merge_base](&main, &topic)); },
+            [&] { keep(graph.mergeBases(graph.find(main), graph.find(topic))); });
+        b.compare("CommitGraph::isAncestor vs descendant_of",
+            [&] { keep(git_graph_descendant_of(&*repo, &main, &topic)); },
+            [&] { keep(graph.isAncestor(graph.find(topic), graph.find(main))); });
+    }
+
+    void runBatchLookup(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto odb = repo[git_repository_odb]();
+        std::vector<git_oid> ids;
+        git2pp::check(git_odb_foreach(&*odb, [](git_oid const * id, void * p) {
+            static_cast<std::vector<git_oid> *>(p)->push_back(*id);
+            return 0;
+        }, &ids));
+        // Caller order is effectively random with respect to pack layout.
+        std::sort(ids.begin(), ids.end(), [](git_oid const & a, git_oid const & b) { return git_oid_cmp(&a, &b) < 0; });
+
+        // Each round opens a fresh handle so that objects come from the odb,
+        // not the handle's object cache. Pack the repo (git gc) to see locality.
+        b.compare("lookupObjects vs git_object_lookup",
+            [&] {
+                auto r = git2[git_repository_open_ext](path, 0, nullptr);
+                for (auto & id : ids) {
+                    keep(r[git_object_lookup](&id, GIT_OBJ_ANY));
+                }
+            },
+            [&] {
+                auto r = git2[git_repository_open_ext](path, 0, nullptr);
+                keep(git2pp::lookupObjects(r, ids));
+            });
+    }
+
+    void runOdbScan(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto odb = repo[git_repository_odb]();
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+
+        b.compare("parallelOdbScan vs git_odb_foreach+read_header",
+            [&] {
+                struct Scan {
+                    git_odb * odb;
+                    git2pp::TypeHistogram types;
+                } scan{&*odb, {}};
+                git2pp::check(git_odb_foreach(&*odb, [](git_oid const * id, void * p) {
+                    auto & scan = *static_cast<Scan *>(p);
+                    git2pp::OdbScanEntry e{*id, GIT_OBJ_ANY, 0, {}};
+                    git2pp::check(git_odb_read_header(&e.size, &e.type, scan.odb, id));
+                    scan.types(e);
+                    return 0;
+                }, &scan));
+                keep(scan.types.objects());
+            },
+            [&] {
+                keep(git2pp::parallelOdbScan(repos, threads, git2pp::TypeHistogram{}).objects());
+            });
+    }
+
+    void runHistoryStats(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+
+        b.compare("historyStats vs serial diff+get_stats",
+            [&] {
+                auto walk = repo[git_revwalk_new]();
+                git2pp::check(walk[git_revwalk_push_head]());
+                for (auto && oid : walk) {
+                    auto commit = repo[git_commit_lookup](&oid);
+                    auto tree = commit[git_commit_tree]();
+                    git2pp::UniquePtr<git_tree> parentTree;
+                    if (commit[git_commit_parentcount]()) {
+                        parentTree = commit[git_commit_parent](0)[git_commit_tree]();
+                    }
+                    auto diff = repo[git_diff_tree_to_tree](parentTree ? &*parentTree : nullptr, &*tree, nullptr);
+                    keep(diff[git_diff_get_stats]());
+                }
+            },
+            [&] {
+                auto walk = repo[git_revwalk_new]();
+                git2pp::check(walk[git_revwalk_push_head]());
+                keep(git2pp::historyStats(repos, threads, walk).rows());
+            });
+    }
+
+    void runDiffView(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto walk = repo[git_revwalk_new]();
+        git2pp::check(walk[git_revwalk_push_head]());
+        git_oid oldest{};
+        for (auto && oid : walk) {
+            oldest = oid;
+        }
+        auto from = repo[git_commit_lookup](&oldest)[git_commit_tree]();
+        auto to = repo[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        auto diff = repo[git_diff_tree_to_tree](&*from, &*to, nullptr);
+
+        b.compare("DiffView vs git_patch + string copies",
+            [&] {
+                std::vector<std::string> lines;
+                size_t n = diff[git_diff_num_deltas]();
+                for (size_t i = 0; i < n; ++i) {
+                    auto patch = git2pp::detail::wrap(git_patch_from_diff, &*diff, i);
+                    if (!patch) {
+                        continue;
+                    }
+                    for (size_t h = 0; h < patch[git_patch_num_hunks](); ++h) {
+                        int count = patch[git_patch_num_lines_in_hunk](h);
+                        for (int l = 0; l < count; ++l) {
+                            git_diff_line const * line;
+                            git2pp::check(git_patch_get_line_in_hunk(&line, &*patch, h, size_t(l)));
+                            lines.emplace_back(line->content, line->content_len);
+                        }
+                    }
+                }
+                keep(lines);
+            },
+            [&] {
+                keep(git2pp::DiffView{diff});
+            });
+    }
+
+    void runBlame(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+        auto head = repo[git_reference_name_to_id]("HEAD");
+        auto tree = repo[git_commit_lookup](&head)[git_commit_tree]();
+        std::vector<std::string> paths;
+        git2pp::check(git_tree_walk(&*tree, GIT_TREEWALK_PRE, [](char const * root, git_tree_entry const * e, void * p) {
+            if (git_tree_entry_type(e) == GIT_OBJ_BLOB) {
+                static_cast<std::vector<std::string> *>(p)->push_back(std::string{root} + git_tree_entry_name(e));
+            }
+            return 0;
+        }, &paths));
+
+        b.compare("blameMany vs serial git_blame_file",
+            [&] {
+                for (auto & p : paths) {
+                    keep(repo[git_blame_file](p.c_str(), nullptr));
+                }
+            },
+            [&] {
+                git2pp::blameMany(repos, threads, head, paths, [&](std::string const &, git2pp::UniquePtr<git_blame> && blame) {
+                    keep(blame);
+                });
+            });
+    }
+
+    void runTreeBuilder(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+        // Rewrites HEAD's tree from its files' content.
+        auto head = repo[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        std::vector<std::pair<std::string, git_oid>> ids;
+        git2pp::check(git_tree_walk(&*head, GIT_TREEWALK_PRE, [](char const * root, git_tree_entry const * e, void * p) {
+            if (git_tree_entry_type(e) == GIT_OBJ_BLOB) {
+                static_cast<std::vector<std::pair<std::string, git_oid>> *>(p)->emplace_back(
+                    std::string{root} + git_tree_entry_name(e), *git_tree_entry_id(e));
+            }
+            return 0;
+        }, &ids));
+        std::vector<std::pair<std::string, std::string>> files;
+        for (auto & i : ids) {
+            auto blob = repo[git_blob_lookup](&i.second);
+            files.emplace_back(i.first, std::string{blob.view()});
+        }
+
+        b.compare("TreeBuilder vs in-memory index",
+            [&] {
+                auto index = git2[git_index_new]();
+                for (auto & f : files) {
+                    git_index_entry entry{};
+                    entry.mode = GIT_FILEMODE_BLOB;
+                    entry.path = f.first.c_str();
+                    entry.id = repo[git_blob_create_frombuffer](f.second.data(), f.second.size());
+                    git2pp::check(git_index_add(&*index, &entry));
+                }
+                keep(index[git_index_write_tree_to](&*repo));
+            },
+            [&] {
+                git2pp::TreeBuilder tb{repo};
+                tb.reserve(files.size());
+                for (auto & f : files) {
+                    tb.add(f.first, GIT_FILEMODE_BLOB, f.second);
+                }
+                keep(tb.write(repos, threads));
+            });
+    }
+
+    void runStatus(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        if (repo[git_repository_is_bare]()) {
+            return;
+        }
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+        git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+        opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED;
+
+        b.compare("parallelStatus vs git_status_list_new",
+            [&] { keep(repo[git_status_list_new](&opts)); },
+            [&] { keep(git2pp::parallelStatus(repos, threads, &opts)); });
+    }
+
+    void runStage(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        if (repo[git_repository_is_bare]()) {
+            return;
+        }
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+        // A tracked file is put into conflict before each staging. The index
+        // is only changed in memory and reread at the end.
+        auto index = repo[git_repository_index]();
+        std::string workdir = repo[git_repository_workdir]();
+        git_index_entry entry{};
+        std::string file;
+        for (size_t i = 0, n = index[git_index_entrycount](); i < n && file.empty(); ++i) {
+            auto e = index[git_index_get_byindex](i);
+            if (e->mode == GIT_FILEMODE_BLOB && std::filesystem::is_regular_file(workdir + e->path)) {
+                entry = *e;
+                file = e->path;
+            }
+        }
+        if (file.empty()) {
+            return;
+        }
+        entry.path = file.c_str();
+        std::vector<std::string> paths{file};
+        auto conflict = [&] { git2pp::check(git_index_conflict_add(&*index, &entry, &entry, &entry)); };
+
+        conflict();
+        git2pp::stagePaths(repos, threads, index, paths);
+        b.expect("stagePaths resolves a conflicted path",
+                 !index[git_index_has_conflicts]() && index[git_index_reuc_entrycount]() > 0);
+
+        b.compare("stagePaths conflict vs git_index_add_bypath",
+            [&] {
+                conflict();
+                git2pp::check(git_index_add_bypath(&*index, file.c_str()));
+            },
+            [&] {
+                conflict();
+                keep(git2pp::stagePaths(repos, threads, index, paths));
+            });
+        git2pp::check(index[git_index_read](1));
+    }
+
+    void runCheckout(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        git2pp::RepositoryPool repos{git2, path};
+        git2pp::ThreadPool threads;
+        auto tree = repo[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        // Each run writes into an emptied scratch directory.
+        auto dir = (std::filesystem::temp_directory_path() / "git2pp-bench-checkout").string();
+        git2pp::CheckoutOptions opts;
+        opts.directory = dir;
+        opts.writeIndex = false;
+
+        b.compare("checkoutFresh vs git_checkout_tree",
+            [&] {
+                std::filesystem::remove_all(dir);
+                git_checkout_options co = GIT_CHECKOUT_OPTIONS_INIT;
+                co.checkout_strategy = GIT_CHECKOUT_FORCE | GIT_CHECKOUT_DONT_UPDATE_INDEX;
+                co.target_directory = dir.c_str();
+                git2pp::check(repo[git_checkout_tree](reinterpret_cast<git_object const *>(&*tree), &co));
+            },
+            [&] {
+                std::filesystem::remove_all(dir);
+                keep(git2pp::checkoutFresh(repos, threads, tree, opts));
+            });
+        std::filesystem::remove_all(dir);
+    }
+
+    void runRefSnapshot(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        git2pp::RefSnapshot refs{repo};
+
+        b.compare("RefSnapshot::prefix vs reference glob iterator",
+            [&] {
+                auto i = repo[git_reference_iterator_glob_new]("refs/tags/*");
+                char const * name;
+                size_t n = 0;
+                while (git_reference_next_name(&name, &*i) == 0) {
+                    ++n;
+                }
+                keep(n);
+            },
+            [&] {
+                size_t n = 0;
+                for (auto & ref : refs.prefix("refs/tags/")) {
+                    keep(ref);
+                    ++n;
+                }
+                keep(n);
+            });
+    }
+
+    void runPackWriter(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto head = repo[git_revparse_single]("HEAD");
+        git_oid id = *git_object_id(&*head);
+
+        b.compare("PackWriter vs git_packbuilder_write_buf",
+            [&] {
+                auto pb = repo[git_packbuilder_new]();
+                auto walk = repo[git_revwalk_new]();
+                git2pp::check(walk[git_revwalk_push](&id));
+                git2pp::check(pb[git_packbuilder_insert_walk](&*walk));
+                git_buf buf{};
+                git2pp::check(git_packbuilder_write_buf(&buf, &*pb));
+                keep(buf.size);
+                git_buf_free(&buf);
+            },
+            [&] {
+                git2pp::PackWriter pw{repo};
+                auto walk = repo[git_revwalk_new]();
+                git2pp::check(walk[git_revwalk_push](&id));
+                pw.insertWalk(walk);
+                keep(pw.write([](char const * data, size_t size) { keep(data[size - 1]); }));
+            });
+    }
+
+#if LIBGIT2PP_HAVE_ODB_BACKEND_DATA
+    void runHotObjects(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto hotRepo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto odb = repo[git_repository_odb]();
+        auto hotOdb = hotRepo[git_repository_odb]();
+        // HEAD's trees and blobs, which the odb cache doesn't keep for blobs.
+        auto head = repo[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        std::vector<git_oid> ids{*head[git_tree_id]()};
+        git2pp::check(git_tree_walk(&*head, GIT_TREEWALK_PRE, [](char const *, git_tree_entry const * e, void * p) {
+            static_cast<std::vector<git_oid> *>(p)->push_back(*git_tree_entry_id(e));
+            return 0;
+        }, &ids));
+        auto file = (std::filesystem::temp_directory_path() / "git2pp-bench.hot").string();
+        git2pp::HotObjectFile::write(file, odb, ids);
+        git2pp::addBackend(hotOdb, std::make_shared<git2pp::HotObjectFile>(file), 3);
+        std::filesystem::remove(file);
+
+        b.compare("HotObjectFile vs default odb backends",
+            [&] {
+                for (auto & id : ids) {
+                    keep(odb[git_odb_read](&id));
+                }
+            },
+            [&] {
+                for (auto & id : ids) {
+                    keep(hotOdb[git_odb_read](&id));
+                }
+            });
+    }
+#endif
+
+#if LIBGIT2PP_HAVE_COROUTINES
+    void runGenerators(Bench & b, char const * path) {
+        git2pp::Session git2;
+        auto repo = git2[git_repository_open_ext](path, 0, nullptr);
+        auto tree = repo[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        auto odb = repo[git_repository_odb]();
+
+        b.compare("treeWalk vs git_tree_walk",
+            [&] {
+                size_t n = 0;
+                git2pp::check(git_tree_walk(&*tree, GIT_TREEWALK_PRE,
+                    [](char const *, git_tree_entry const *, void * p) { ++*static_cast<size_t *>(p); return 0; }, &n));
+                keep(n);
+            },
+            [&] {
+                size_t n = 0;
+                for (auto && e : git2pp::treeWalk(tree)) {
+                    keep(e);
+                    ++n;
+                }
+                keep(n);
+            });
+        b.compare("odbForeach vs git_odb_foreach",
+            [&] {
+                size_t n = 0;
+                git2pp::check(git_odb_foreach(&*odb,
+                    [](git_oid const *, void * p) { ++*static_cast<size_t *>(p); return 0; }, &n));
+                keep(n);
+            },
+            [&] {
+                size_t n = 0;
+                for (auto && id : git2pp::odbForeach(odb)) {
+                    keep(id);
+                    ++n;
+                }
+                keep(n);
+            });
+    }
+#endif
+
+    size_t parseSize(char const * s) {
+        return size_t(std::strtoull(s, nullptr, 10));
+    }
+
+}
+
+int main(int argc, char * argv[]) {
+    Options opts;
+    char const * path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--commits" && hasValue) {
+            opts.spec.commits = parseSize(argv[++i]);
+        } else if (arg == "--width" && hasValue) {
+            opts.spec.width = parseSize(argv[++i]);
+        } else if (arg == "--depth" && hasValue) {
+            opts.spec.depth = parseSize(argv[++i]);
+        } else if (arg == "--refs" && hasValue) {
+            opts.spec.refs = parseSize(argv[++i]);
+        } else if (arg == "--notes" && hasValue) {
+            opts.spec.notes = parseSize(argv[++i]);
+        } else if (arg == "--min-time" && hasValue) {
+            opts.minTime = std::atof(argv[++i]);
+        } else if (arg == "--max-ratio" && hasValue) {
+            opts.maxRatio = std::atof(argv[++i]);
+        } else if (arg == "--filter" && hasValue) {
+            opts.filter = argv[++i];
+        } else if (arg == "--allocator" && hasValue) {
+            opts.allocator = argv[++i];
+        } else if (arg == "--tuning" && hasValue) {
+            opts.tuning = argv[++i];
+        } else if (arg[0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            path = nullptr;
+            break;
+        }
+    }
+    if (!path || opts.spec.commits == 0 || opts.spec.width == 0) {
+        std::cerr << "Usage: bench [--commits N] [--width N] [--depth N] [--refs N] [--notes N]\n"
+                     "             [--min-time SECONDS] [--max-ratio R] [--filter SUBSTR]\n"
+                     "             [--allocator malloc|pool|arena] [--tuning server|cli|low-memory]\n"
+                     "             <repo-dir>\n"
+                     "Generates a synthetic repository at <repo-dir> if it doesn't exist.\n";
+        return 1;
+    }
+
+    // Installed by a Session that outlives all the others.
+    static git2pp::MallocAllocator mallocAllocator;
+    static git2pp::PoolAllocator poolAllocator;
+    static git2pp::ArenaAllocator arenaAllocator;
+    std::unique_ptr<git2pp::Session> allocatorSession;
+    if (!opts.allocator.empty()) {
+        git2pp::Allocator * allocator = nullptr;
+        if (opts.allocator == "malloc") {
+            allocator = &mallocAllocator;
+        } else if (opts.allocator == "pool") {
+            allocator = &poolAllocator;
+        } else if (opts.allocator == "arena") {
+            allocator = &arenaAllocator;
+        }
+        if (!allocator) {
+            std::cerr << "Unknown allocator: " << opts.allocator << "\n";
+            return 1;
+        }
+        allocatorSession = std::make_unique<git2pp::Session>(*allocator);
+    }
+
+    if (!opts.tuning.empty()) {
+        git2pp::Session git2;
+        if (opts.tuning == "server") {
+            git2pp::Session::tune(git2pp::Tuning::server());
+        } else if (opts.tuning == "cli") {
+            git2pp::Session::tune(git2pp::Tuning::cli());
+        } else if (opts.tuning == "low-memory") {
+            git2pp::Session::tune(git2pp::Tuning::lowMemory());
+        } else {
+            std::cerr << "Unknown tuning: " << opts.tuning << "\n";
+            return 1;
+        }
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        git2pp::Session git2;
+        auto tip = synth::generate(git2, path, opts.spec);
+        std::cout << "generated " << path << " main = " << &tip << "\n";
+    }
+
+    Bench b{opts};
+    run(b, path);
+    runContainers(b, path);
+    runGraph(b, path);
+    runBatchLookup(b, path);
+    runOdbScan(b, path);
+    runHistoryStats(b, path);
+    runDiffView(b, path);
+    runBlame(b, path);
+    runTreeBuilder(b, path);
+    runStatus(b, path);
+    runStage(b, path);
+    runCheckout(b, path);
+    runRefSnapshot(b, path);
+    runPackWriter(b, path);
+#if LIBGIT2PP_HAVE_ODB_BACKEND_DATA
+    runHotObjects(b, path);
+#endif
+#if LIBGIT2PP_HAVE_COROUTINES
+    runGenerators(b, path);
+#endif
+    if (allocatorSession) {
+        auto mem = git2pp::Session::memoryStats();
+        std::cout << "libgit2 memory: " << mem.liveBytes << " bytes live, " << mem.peakBytes << " peak, "
+                  << mem.allocations << " allocations (" << std::setprecision(0)
+                  << mem.allocationsPerSecond() << "/s)\n";
+    }
+    if (!opts.tuning.empty()) {
+        git2pp::Session git2;
+        auto cache = git2pp::Session::cacheStats();
+        std::cout << "object cache limit: " << cache.cacheLimit << " bytes, pack window: "
+                  << cache.mwindowSize << " bytes\n";
+    }
+    return b.failed() ? 2 : 0;
+}
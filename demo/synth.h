@@ -0,0 +1,163 @@
+//
+//  libgit2pp
+//
+//  https://github.com/marcelocantos/libgit2pp
+//
+//  Distributed under the Apache License, Version 2.0. (See accompanying
+//  file LICENSE or copy at http://www.apache.org/licenses/LICENSE-2.0)
+//
+
+// Deterministic synthetic repository generator. Given the same Spec, produces
+// byte-identical objects (and therefore identical oids) on every run.
+
+#ifndef GIT2PP_DEMO_SYNTH_H
+#define GIT2PP_DEMO_SYNTH_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../git2pp.h"
+
+namespace synth {
+
+    struct Spec {
+        size_t commits = 1000;  // Linear history on refs/heads/main.
+        size_t width = 16;      // Files per directory level.
+        size_t depth = 4;       // Nested directory levels below the root.
+        size_t refs = 100;      // Branches and tags, each spread along history.
+        size_t notes = 100;     // Notes on the first commits of history.
+        size_t topic = 4;       // Commits on refs/heads/topic, forked mid-history.
+    };
+
+    namespace detail {
+
+        inline std::string name(char const * prefix, size_t i) {
+            char buf[48];
+            std::snprintf(buf, sizeof(buf), "%s%06zu", prefix, i);
+            return buf;
+        }
+
+        inline git2pp::UniquePtr<git_signature> signature(git2pp::Session & git2, size_t i) {
+            return git2[git_signature_new]("Synth", "synth@example.com", git_time_t(1500000000 + 60 * i), 0);
+        }
+
+        // Tree ids for each level of the directory chain, root first. Each level
+        // holds `width` files named f000000… and, except the deepest, a "d" subdir.
+        class Chain {
+        public:
+            Chain(git2pp::UniquePtr<git_repository> & repo, Spec const & spec)
+            : repo_{repo}, spec_{spec}, trees_(spec.depth + 1) {
+                for (size_t level = spec.depth + 1; level-- > 0;) {
+                    auto tb = repo_[git_treebuilder_new](nullptr);
+                    for (size_t k = 0; k < spec.width; ++k) {
+                        insertBlob(tb, level, k, 0);
+                    }
+                    if (level < spec.depth) {
+                        git2pp::check(git_treebuilder_insert(nullptr, &*tb, "d", &trees_[level + 1], GIT_FILEMODE_TREE));
+                    }
+                    trees_[level] = tb[git_treebuilder_write]();
+                }
+            }
+
+            git_oid const & root() const { return trees_[0]; }
+
+            // Rewrites one file at `level` and every tree on the path up to the root.
+            void touch(size_t level, size_t k, size_t rev) {
+                for (size_t l = level + 1; l-- > 0;) {
+                    auto tree = repo_[git_tree_lookup](&trees_[l]);
+                    auto tb = repo_[git_treebuilder_new](&*tree);
+                    if (l == level) {
+                        insertBlob(tb, l, k, rev);
+                    } else {
+                        git2pp::check(git_treebuilder_insert(nullptr, &*tb, "d", &trees_[l + 1], GIT_FILEMODE_TREE));
+                    }
+                    trees_[l] = tb[git_treebuilder_write]();
+                }
+            }
+
+        private:
+            git2pp::UniquePtr<git_repository> & repo_;
+            Spec spec_;
+            std::vector<git_oid> trees_;
+
+            void insertBlob(git2pp::UniquePtr<git_treebuilder> & tb, size_t level, size_t k, size_t rev) {
+                char content[64];
+                int len = std::snprintf(content, sizeof(content), "level %zu file %zu rev %zu\n", level, k, rev);
+                auto blob = repo_[git_blob_create_frombuffer](content, size_t(len));
+                git2pp::check(git_treebuilder_insert(nullptr, &*tb, name("f", k).c_str(), &blob, GIT_FILEMODE_BLOB));
+            }
+        };
+
+    }
+
+    // Creates a non-bare repository at `path` and returns the tip of main.
+    inline git_oid generate(git2pp::Session & git2, char const * path, Spec const & spec) {
+        auto repo = git2[git_repository_init](path, 0);
+        detail::Chain chain{repo, spec};
+
+        std::vector<git_oid> history;
+        history.reserve(spec.commits);
+        for (size_t i = 0; i < spec.commits; ++i) {
+            if (i > 0) {
+                chain.touch(i % (spec.depth + 1), (i * 7) % spec.width, i);
+            }
+            auto sig = detail::signature(git2, i);
+            auto tree = repo[git_tree_lookup](&chain.root());
+            auto message = detail::name("commit ", i) + "\n";
+            git2pp::UniquePtr<git_commit> parent;
+            if (i > 0) {
+                parent = repo[git_commit_lookup](&history.back());
+            }
+            git_commit const * parents[] = {parent ? &*parent : nullptr};
+            history.push_back(repo[git_commit_create](
+                nullptr, &*sig, &*sig, nullptr, message.c_str(), &*tree, i > 0 ? 1 : 0, parents));
+        }
+        git_oid tip = history.back();
+
+        repo[git_reference_create]("refs/heads/main", &tip, 1, nullptr);
+        git2pp::check(repo[git_repository_set_head]("refs/heads/main"));
+
+        for (size_t j = 0; j < spec.refs; ++j) {
+            auto & target = history[j * history.size() / spec.refs];
+            auto ref = detail::name(j % 2 ? "refs/tags/tag-" : "refs/heads/branch-", j);
+            repo[git_reference_create](ref.c_str(), &target, 1, nullptr);
+        }
+
+        if (spec.topic) {
+            auto base = history[history.size() / 2];
+            auto parent = repo[git_commit_lookup](&base);
+            for (size_t i = 0; i < spec.topic; ++i) {
+                auto tree = parent[git_commit_tree]();
+                auto tb = repo[git_treebuilder_new](&*tree);
+                auto content = detail::name("topic ", i) + "\n";
+                auto blob = repo[git_blob_create_frombuffer](content.data(), content.size());
+                git2pp::check(git_treebuilder_insert(nullptr, &*tb, detail::name("topic", i).c_str(), &blob, GIT_FILEMODE_BLOB));
+                auto treeId = tb[git_treebuilder_write]();
+                auto newTree = repo[git_tree_lookup](&treeId);
+                auto sig = detail::signature(git2, spec.commits + i);
+                auto message = detail::name("topic ", i) + "\n";
+                git_commit const * parents[] = {&*parent};
+                auto id = repo[git_commit_create](nullptr, &*sig, &*sig, nullptr, message.c_str(), &*newTree, 1, parents);
+                parent = repo[git_commit_lookup](&id);
+            }
+            repo[git_reference_create]("refs/heads/topic", parent[git_commit_id](), 1, nullptr);
+        }
+
+        for (size_t i = 0; i < spec.notes && i < history.size(); ++i) {
+            auto sig = detail::signature(git2, i);
+            auto note = detail::name("note ", i);
+            repo[git_note_create](nullptr, &*sig, &*sig, &history[i], note.c_str(), 0);
+        }
+
+        auto index = repo[git_repository_index]();
+        auto tree = repo[git_tree_lookup](&chain.root());
+        git2pp::check(index[git_index_read_tree](&*tree));
+        git2pp::check(index[git_index_write]());
+
+        return tip;
+    }
+
+}
+
+#endif // GIT2PP_DEMO_SYNTH_H
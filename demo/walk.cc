@@ -14,6 +14,11 @@ void show_commit(char const * shorthand) {
     std::cout << "author = " << parent0[git_commit_author]()->name << "\n";
     std::cout << "message = " << parent0[git_commit_message]() << "\n";
 
+    auto missing = repo.try_()[git_reference_dwim]("no-such-branch");
+    if (!missing && missing.rc() == GIT_ENOTFOUND) {
+        std::cout << "no-such-branch: not found (" << missing.message() << ")\n";
+    }
+
     auto revwalk = repo[git_revwalk_new]();
     revwalk[git_revwalk_sorting](GIT_SORT_TIME);
     revwalk[git_revwalk_push](commit[git_commit_id]());
@@ -52,6 +57,17 @@ void show_commit(char const * shorthand) {
         std::cout << "  " << conflict.ancestor << "\n";
     }
 
+#if LIBGIT2PP_HAVE_COROUTINES
+    std::cout << "tree (first 10 entries):\n";
+    int shown = 0;
+    for (auto && e : git2pp::treeWalk(commit[git_commit_tree]())) {
+        std::cout << "  " << e.root << git_tree_entry_name(e.entry) << "\n";
+        if (++shown == 10) {
+            break;
+        }
+    }
+#endif
+
     char const * notes = "refs/notes/commits";
     try {
         std::cout << "notes:\n";
@@ -80,4 +96,10 @@ int main(int argc, char * argv[]) {
         return 1;
     }
     show_commit(argv[1]);
+
+    // Build with -DGIT2PP_INSTRUMENT=1 to see where libgit2 time went.
+    if (GIT2PP_INSTRUMENT) {
+        std::cout << "instrumentation:\n";
+        git2pp::instrument::report(std::cout);
+    }
 }
@@ -11,26 +11,125 @@
 #define GIT2PP_H
 
 #include <git2.h>
+#include <git2/sys/index.h>
+#include <git2/sys/repository.h>
 
 #if !(LIBGIT2_VER_MAJOR == 0 && LIBGIT2_VER_MINOR < 28)
 # define LIBGIT2PP_HAVE_INDEX_ITERATOR 1
 #else
 # define LIBGIT2PP_HAVE_INDEX_ITERATOR 0
 #endif
+#if !(LIBGIT2_VER_MAJOR == 0 && LIBGIT2_VER_MINOR < 28)
+# define LIBGIT2PP_HAVE_SIZED_RSTREAM 1
+# define LIBGIT2PP_HAVE_ALLOCATOR 1
+# define LIBGIT2PP_HAVE_ODB_BACKEND_DATA 1
+#else
+# define LIBGIT2PP_HAVE_SIZED_RSTREAM 0
+# define LIBGIT2PP_HAVE_ALLOCATOR 0
+# define LIBGIT2PP_HAVE_ODB_BACKEND_DATA 0
+#endif
 #if !(LIBGIT2_VER_MAJOR == 0 && LIBGIT2_VER_MINOR < 25)
 # define LIBGIT2PP_HAVE_REFERENCE_DUP 1
 #else
 # define LIBGIT2PP_HAVE_REFERENCE_DUP 0
 #endif
 
+#ifndef GIT2PP_INSTRUMENT
+# define GIT2PP_INSTRUMENT 0
+#endif
+
+#if !(LIBGIT2_VER_MAJOR == 0 || (LIBGIT2_VER_MAJOR == 1 && LIBGIT2_VER_MINOR < 1))
+# define LIBGIT2PP_HAVE_MWINDOW_FILE_LIMIT 1
+#else
+# define LIBGIT2PP_HAVE_MWINDOW_FILE_LIMIT 0
+#endif
+
+#if !(LIBGIT2_VER_MAJOR == 0 || (LIBGIT2_VER_MAJOR == 1 && LIBGIT2_VER_MINOR < 2))
+# define LIBGIT2PP_HAVE_THREADSAFE_ODB 1
+#else
+# define LIBGIT2PP_HAVE_THREADSAFE_ODB 0
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+# define LIBGIT2PP_HAVE_COROUTINES 1
+#else
+# define LIBGIT2PP_HAVE_COROUTINES 0
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+# define LIBGIT2PP_HAVE_SPAN 1
+#else
+# define LIBGIT2PP_HAVE_SPAN 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <shared_mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if LIBGIT2PP_HAVE_ALLOCATOR
+# include <git2/sys/alloc.h>
+#endif
+#if LIBGIT2PP_HAVE_ODB_BACKEND_DATA
+# include <git2/sys/odb_backend.h>
+#endif
+
+#if LIBGIT2PP_HAVE_COROUTINES
+# include <coroutine>
+#endif
+#if LIBGIT2PP_HAVE_SPAN
+# include <span>
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<bit>)
+# include <bit>
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+#if !defined(_WIN32)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#if GIT2PP_INSTRUMENT && !defined(_WIN32)
+# include <dlfcn.h>
+#endif
 
 inline
 std::ostream & operator<<(std::ostream & os, git_oid const * oid) {
@@ -43,19 +142,357 @@ namespace git2pp {
     class Error : public std::runtime_error {
     public:
         using runtime_error::runtime_error;
+
+        Error(int rc, int klass, std::string const & what)
+        : runtime_error{what}, rc_{rc}, klass_{klass}
+        { }
+
+        // The libgit2 return code (e.g., GIT_ENOTFOUND) and error class
+        // (e.g., GIT_ERROR_REFERENCE) of the failed call.
+        int rc() const { return rc_; }
+        int klass() const { return klass_; }
+
+    private:
+        int rc_ = GIT_ERROR;
+        int klass_ = 0;
     };
 
 
+    namespace detail {
+
+        inline
+        Error error(int rc, git_error const * err) {
+            std::ostringstream oss;
+            oss << "git2 error " << rc;
+            if (err) {
+                oss << "/" << err->klass <<  ": " << err->message;
+            }
+            return {rc, err ? err->klass : 0, oss.str()};
+        }
+
+    }
+
+
     inline
     void check(int rc) {
         if (rc < 0) {
-            std::ostringstream oss;
-            oss << "git2 error " << rc;
+            throw detail::error(rc, giterr_last());
+        }
+    }
+
+
+    // Outcome of a call made through try_(). Holds either the call's output or
+    // the failing return code. Nothing is formatted or thrown unless asked for,
+    // so expected failures such as GIT_ENOTFOUND cost no more than the call.
+    template <typename T>
+    class Result {
+    public:
+        Result(T t) : t_{std::move(t)} { }
+
+        static Result failure(int rc) {
+            Result result{T{}};
+            result.rc_ = rc;
             if (auto err = giterr_last()) {
-                oss << "/" << err->klass <<  ": " << err->message;
+                result.klass_ = err->klass;
+            }
+            return result;
+        }
+
+        explicit operator bool() const { return rc_ >= 0; }
+
+        int rc() const { return rc_; }
+        int klass() const { return klass_; }
+
+        // libgit2's last error message for this thread. Only meaningful until
+        // the next failing libgit2 call on the same thread.
+        char const * message() const {
+            auto err = rc_ < 0 ? giterr_last() : nullptr;
+            return err ? err->message : "";
+        }
+
+        // The Error check() would have thrown for this failure.
+        Error error() const { return detail::error(rc_, rc_ < 0 ? giterr_last() : nullptr); }
+
+        T & value() & { throwIfFailed(); return t_; }
+        T && value() && { throwIfFailed(); return std::move(t_); }
+
+        T & operator*() & { return t_; }
+        T && operator*() && { return std::move(t_); }
+        T * operator->() { return &t_; }
+
+    private:
+        T t_;
+        int rc_ = 0;
+        int klass_ = 0;
+
+        void throwIfFailed() const {
+            if (rc_ < 0) {
+                throw error();
+            }
+        }
+    };
+
+
+    // Per-function call statistics, collected when GIT2PP_INSTRUMENT is
+    // nonzero. Every libgit2 call made through operator[], wrap(), try_() and
+    // the iterables is counted and timed. Each thread records into its own
+    // table with no shared writes; snapshot() sums the tables. When
+    // instrumentation is off, snapshot() is empty and the calls compile to
+    // plain function calls.
+    namespace instrument {
+
+        constexpr size_t histogramBuckets = 40;
+
+        struct FunctionStats {
+            void const * function = nullptr;
+            std::string name;       // Symbol name if it can be resolved.
+            uint64_t calls = 0;
+            uint64_t errors = 0;    // Negative returns, for calls that return error codes.
+            uint64_t totalNs = 0;
+            // histogram[i] counts calls taking [2^(i-1), 2^i) ns; [0] counts 0 ns.
+            uint64_t histogram[histogramBuckets] = {};
+
+            // Upper bound of the bucket holding the p-th percentile (0 < p <= 100).
+            uint64_t percentileNs(double p) const {
+                uint64_t target = uint64_t(p / 100 * double(calls) + 0.5);
+                uint64_t seen = 0;
+                for (size_t i = 0; i < histogramBuckets; ++i) {
+                    seen += histogram[i];
+                    if (seen >= target && seen) {
+                        return i ? uint64_t(1) << i : 0;
+                    }
+                }
+                return 0;
+            }
+        };
+
+        struct Snapshot {
+            std::vector<FunctionStats> functions;   // Sorted by totalNs, descending.
+            uint64_t totalNs = 0;
+        };
+
+        namespace detail {
+
+            struct Counters {
+                std::atomic<uint64_t> calls{0}, errors{0}, ns{0};
+                std::atomic<uint64_t> histogram[histogramBuckets] = {};
+            };
+
+            // Written only by its owning thread, so updates are plain
+            // load/store pairs; readers see relaxed but untorn values.
+            class ThreadTable {
+            public:
+                static constexpr size_t capacity = 1024;
+
+                Counters * counters(void const * fn) {
+                    size_t h = (reinterpret_cast<uintptr_t>(fn) >> 4) & (capacity - 1);
+                    for (size_t i = 0; i < capacity; ++i, h = (h + 1) & (capacity - 1)) {
+                        auto & slot = slots_[h];
+                        auto key = slot.fn.load(std::memory_order_relaxed);
+                        if (key == fn) {
+                            return slot.counters.load(std::memory_order_relaxed);
+                        }
+                        if (!key) {
+                            auto c = new Counters;
+                            slot.counters.store(c, std::memory_order_relaxed);
+                            slot.fn.store(fn, std::memory_order_release);
+                            return c;
+                        }
+                    }
+                    return nullptr;     // Full; stop recording new functions.
+                }
+
+                template <typename F>
+                void forEach(F && f) const {
+                    for (auto & slot : slots_) {
+                        if (auto fn = slot.fn.load(std::memory_order_acquire)) {
+                            f(fn, *slot.counters.load(std::memory_order_relaxed));
+                        }
+                    }
+                }
+
+                ~ThreadTable() {
+                    for (auto & slot : slots_) {
+                        delete slot.counters.load(std::memory_order_relaxed);
+                    }
+                }
+
+            private:
+                struct Slot {
+                    std::atomic<void const *> fn{nullptr};
+                    std::atomic<Counters *> counters{nullptr};
+                };
+                Slot slots_[capacity];
+            };
+
+            struct Registry {
+                std::mutex mutex;
+                std::vector<std::shared_ptr<ThreadTable>> tables;
+                std::vector<FunctionStats> baseline;
+            };
+
+            // Never destroyed, so threads and static destructors that run
+            // after main() can still record and report.
+            inline Registry & registry() {
+                static Registry * r = new Registry;
+                return *r;
+            }
+
+            inline ThreadTable & table() {
+                static thread_local std::shared_ptr<ThreadTable> t = [] {
+                    auto t = std::make_shared<ThreadTable>();
+                    auto & r = registry();
+                    std::lock_guard<std::mutex> lock{r.mutex};
+                    r.tables.push_back(t);
+                    return t;
+                }();
+                return *t;
+            }
+
+            inline void bump(std::atomic<uint64_t> & a, uint64_t n) {
+                a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            inline void record(void const * fn, uint64_t ns, bool error) {
+                if (auto c = table().counters(fn)) {
+                    bump(c->calls, 1);
+                    bump(c->errors, error);
+                    bump(c->ns, ns);
+                    size_t bucket = 0;
+                    for (uint64_t v = ns; v && bucket < histogramBuckets - 1; v >>= 1) {
+                        ++bucket;
+                    }
+                    bump(c->histogram[bucket], 1);
+                }
+            }
+
+            inline std::string symbolName(void const * fn) {
+#if GIT2PP_INSTRUMENT && !defined(_WIN32)
+                Dl_info info;
+                if (dladdr(fn, &info) && info.dli_sname) {
+                    return info.dli_sname;
+                }
+#endif
+                std::ostringstream oss;
+                oss << fn;
+                return oss.str();
+            }
+
+            inline std::vector<FunctionStats> collect(Registry & r) {
+                std::vector<FunctionStats> all;
+                std::unordered_map<void const *, size_t> index;
+                for (auto & t : r.tables) {
+                    t->forEach([&](void const * fn, Counters const & c) {
+                        auto i = index.emplace(fn, all.size());
+                        if (i.second) {
+                            all.emplace_back();
+                            all.back().function = fn;
+                        }
+                        auto & s = all[i.first->second];
+                        s.calls += c.calls.load(std::memory_order_relaxed);
+                        s.errors += c.errors.load(std::memory_order_relaxed);
+                        s.totalNs += c.ns.load(std::memory_order_relaxed);
+                        for (size_t b = 0; b < histogramBuckets; ++b) {
+                            s.histogram[b] += c.histogram[b].load(std::memory_order_relaxed);
+                        }
+                    });
+                }
+                return all;
+            }
+
+        }
+
+        // Totals since startup or the last reset().
+        inline Snapshot snapshot() {
+            Snapshot snap;
+            auto & r = detail::registry();
+            std::lock_guard<std::mutex> lock{r.mutex};
+            snap.functions = detail::collect(r);
+            for (auto & s : snap.functions) {
+                for (auto & b : r.baseline) {
+                    if (b.function == s.function) {
+                        s.calls -= b.calls;
+                        s.errors -= b.errors;
+                        s.totalNs -= b.totalNs;
+                        for (size_t i = 0; i < histogramBuckets; ++i) {
+                            s.histogram[i] -= b.histogram[i];
+                        }
+                    }
+                }
+                s.name = detail::symbolName(s.function);
+                snap.totalNs += s.totalNs;
+            }
+            snap.functions.erase(std::remove_if(snap.functions.begin(), snap.functions.end(),
+                                                [](FunctionStats const & s) { return !s.calls; }),
+                                 snap.functions.end());
+            std::sort(snap.functions.begin(), snap.functions.end(),
+                      [](FunctionStats const & a, FunctionStats const & b) { return a.totalNs > b.totalNs; });
+            return snap;
+        }
+
+        // Starts a new measurement period. Writers are never blocked: this
+        // records the current totals and snapshot() subtracts them.
+        inline void reset() {
+            auto & r = detail::registry();
+            std::lock_guard<std::mutex> lock{r.mutex};
+            r.baseline = detail::collect(r);
+        }
+
+        inline void report(std::ostream & os, Snapshot const & snap = snapshot()) {
+            auto flags = os.flags();
+            os << std::left << std::setw(36) << "function" << std::right
+               << std::setw(12) << "calls" << std::setw(9) << "errors" << std::setw(12) << "total ms"
+               << std::setw(8) << "%" << std::setw(10) << "mean ns" << std::setw(10) << "p50 ns"
+               << std::setw(10) << "p99 ns" << "\n";
+            for (auto & s : snap.functions) {
+                os << std::left << std::setw(36) << s.name << std::right
+                   << std::setw(12) << s.calls << std::setw(9) << s.errors
+                   << std::setw(12) << std::fixed << std::setprecision(3) << double(s.totalNs) / 1e6
+                   << std::setw(8) << std::setprecision(1) << (snap.totalNs ? 100.0 * double(s.totalNs) / double(snap.totalNs) : 0)
+                   << std::setw(10) << s.totalNs / s.calls
+                   << std::setw(10) << s.percentileNs(50) << std::setw(10) << s.percentileNs(99) << "\n";
+            }
+            os.flags(flags);
+        }
+
+    }
+
+    namespace detail {
+
+        // Error classification for instrumented calls.
+        struct NeverFails {
+            template <typename R> static bool failed(R const &) { return false; }
+        };
+        struct FailsIfNegative {
+            static bool failed(int rc) { return rc < 0; }
+        };
+        struct FailsUnlessIterover {
+            static bool failed(int rc) { return rc < 0 && rc != GIT_ITEROVER; }
+        };
+
+        // Calls f(args...), recording it under f when instrumentation is on.
+        template <typename Failure, typename R, typename... Params, typename... Args>
+        R call(R (*f)(Params...), Args &&... args) {
+#if GIT2PP_INSTRUMENT
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+            auto ns = [&] {
+                return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+            };
+            auto fn = reinterpret_cast<void const *>(f);
+            if constexpr (std::is_void_v<R>) {
+                f(std::forward<Args>(args)...);
+                instrument::detail::record(fn, ns(), false);
+            } else {
+                R r = f(std::forward<Args>(args)...);
+                instrument::detail::record(fn, ns(), Failure::failed(r));
+                return r;
             }
-            throw Error{oss.str()};
+#else
+            return f(std::forward<Args>(args)...);
+#endif
         }
+
     }
 
 
@@ -67,6 +504,30 @@ namespace git2pp {
             void operator()(T * t) const { }
         };
 
+        // Storage for handles that don't own their object (obj_no_free), such
+        // as those a Scope hands out. A bare pointer, so the handle is
+        // trivially destructible and copying it copies the pointer.
+        template <typename T> class Borrowed {
+        public:
+            Borrowed(T * t = nullptr) : t_{t} { }
+
+            T * get() const { return t_; }
+            T * release() { return std::exchange(t_, nullptr); }
+            void reset(T * t = nullptr) { t_ = t; }
+
+            explicit operator bool() const { return t_ != nullptr; }
+            T & operator*() const { return *t_; }
+
+            bool operator==(Borrowed const & that) const { return t_ == that.t_; }
+            bool operator!=(Borrowed const & that) const { return t_ != that.t_; }
+
+        private:
+            T * t_;
+        };
+
+        template <typename T, typename Free> struct Storage { using type = std::unique_ptr<T, Free>; };
+        template <typename T> struct Storage<T, obj_no_free<T>> { using type = Borrowed<T>; };
+
     }
 
 
@@ -169,6 +630,20 @@ namespace git2pp {
         GIT2PP_OBJ_OBJECT_DUP_(tag);
         GIT2PP_OBJ_OBJECT_DUP_(tree);
 
+        template <typename T> struct Content {};
+
+        template <> struct Content<git_blob> {
+            static std::string_view view(git_blob * blob) {
+                return {static_cast<char const *>(git_blob_rawcontent(blob)), size_t(git_blob_rawsize(blob))};
+            }
+        };
+
+        template <> struct Content<git_odb_object> {
+            static std::string_view view(git_odb_object * object) {
+                return {static_cast<char const *>(git_odb_object_data(object)), git_odb_object_size(object)};
+            }
+        };
+
     }
 
     namespace detail {
@@ -183,7 +658,34 @@ namespace git2pp {
         template <typename... Params, typename... Args>
         git_oid wrapOid(int (*f)(git_oid * oid, Params... params), Args &&... args);
 
+        template <typename T, typename... Params, typename... Args>
+        Result<UniquePtr<T>> tryWrap(int (*f)(T * * t, Params... params), Args &&... args);
+
+        template <typename... Params, typename... Args>
+        Result<git_oid> tryWrapOid(int (*f)(git_oid * oid, Params... params), Args &&... args);
+
+        template <typename T, typename Free> class Try;
+
+        // git_reference_dup only exists from libgit2 0.25.
+        template <typename T>
+        constexpr bool copyable = LIBGIT2PP_HAVE_REFERENCE_DUP || !std::is_same_v<T, git_reference>;
+
+        // Stands in for UniquePtr in whichever copy member is disabled.
+        struct Uncopyable;
+
+    }
+
+#if LIBGIT2PP_HAVE_COROUTINES
+    class BlockingPool;
+    class Executor;
+
+    namespace detail {
+
+        template <typename T, typename Free> class Async;
+        class SessionAsync;
+
     }
+#endif
 
 
     template <typename T, typename Free>
@@ -193,25 +695,35 @@ namespace git2pp {
 
         UniquePtr(T * t = nullptr) : t_{t} { }
 
-        template <typename U = T>
-        UniquePtr(UniquePtr const & t, std::enable_if_t<LIBGIT2PP_HAVE_REFERENCE_DUP || !std::is_same_v<U, git_reference>>* = 0)
-        : UniquePtr{t ? t[&detail::obj_dup<T>::dup]() : nullptr}
-        { }
+        // Not templates: a constructor template is never a copy constructor, so
+        // it would leave the implicitly deleted one in charge. Of each pair,
+        // exactly one member takes UniquePtr, so copies of types that can't be
+        // duplicated are deleted rather than failing inside the body. Bodies
+        // are only instantiated when used, so types without an obj_dup still
+        // compile until copied.
+        UniquePtr(std::conditional_t<detail::copyable<T>, UniquePtr, detail::Uncopyable> const & t) : UniquePtr{copy(t)} { }
+        UniquePtr(std::conditional_t<detail::copyable<T>, detail::Uncopyable, UniquePtr> const &) = delete;
 
         UniquePtr(UniquePtr &&) = default;
 
-        UniquePtr & operator=(UniquePtr const & t) {
+        UniquePtr & operator=(std::conditional_t<detail::copyable<T>, UniquePtr, detail::Uncopyable> const & t) {
             if (this != &t) {
-                t_ = std::move(t[&detail::obj_dup<T>::dup]().t_);
+                t_ = std::move(copy(t).t_);
             }
             return *this;
         }
+        UniquePtr & operator=(std::conditional_t<detail::copyable<T>, detail::Uncopyable, UniquePtr> const &) = delete;
         UniquePtr & operator=(UniquePtr &&) = default;
 
         void reset(T * t = nullptr) {
             t_.reset(t);
         }
 
+        // Gives up the object without freeing it.
+        T * release() {
+            return t_.release();
+        }
+
         explicit operator bool() const { return bool(t_); }
 
         T & operator*() const { return *t_; }
@@ -245,20 +757,51 @@ namespace git2pp {
         template <typename R, typename... Params, typename = std::enable_if<!std::is_const_v<T>>>
         auto operator[](R (* method)(T *, Params...)) const {
             return [this, method](auto &&... args) {
-                return method(&*t_, std::forward<decltype(args)>(args)...);
+                return detail::call<detail::NeverFails>(method, &*t_, std::forward<decltype(args)>(args)...);
             };
         }
 
         template <typename R, typename... Params>
         auto operator[](R (* method)(T const *, Params...)) const {
             return [this, method](auto &&... args) {
-                return method(&*t_, std::forward<decltype(args)>(args)...);
+                return detail::call<detail::NeverFails>(method, &*t_, std::forward<decltype(args)>(args)...);
             };
         }
 
+        // Content of a git_blob or git_odb_object, in place. Only valid while
+        // this UniquePtr holds the object, so temporaries can't be viewed.
+        std::string_view view() const & { return detail::Content<T>::view(t_.get()); }
+        std::string_view view() const && = delete;
+
+#if LIBGIT2PP_HAVE_SPAN
+        std::span<std::byte const> bytes() const & {
+            auto v = view();
+            return {reinterpret_cast<std::byte const *>(v.data()), v.size()};
+        }
+        std::span<std::byte const> bytes() const && = delete;
+#endif
+
+        // Non-throwing variants of the output-returning operator[] overloads.
+        // repo.try_()[git_reference_dwim]("x") returns Result<UniquePtr<git_reference>>.
+        detail::Try<T, Free> try_() const { return {this}; }
+
+#if LIBGIT2PP_HAVE_COROUTINES
+        // Awaitable variants of operator[]; see BlockingPool.
+        // co_await repo.async(pool)[git_commit_lookup](&id) runs the lookup
+        // on the pool and returns UniquePtr<git_commit>.
+        detail::Async<T, Free> async(BlockingPool & pool, Executor * executor = nullptr) const {
+            return {this, &pool, executor};
+        }
+#endif
+
+        // Borrowed handles stay borrowed, so a Scope's objects aren't freed twice.
         template <typename U>
-        UniquePtr<U> as() && {
-            return (U *)t_.release();
+        auto as() && {
+            if constexpr (owning) {
+                return UniquePtr<U>{(U *)t_.release()};
+            } else {
+                return UniquePtr<U, detail::obj_no_free<U>>{(U *)t_.release()};
+            }
         }
 
         template <typename U>
@@ -267,7 +810,17 @@ namespace git2pp {
         }
 
     private:
-        std::unique_ptr<T, Free> t_;
+        static constexpr bool owning = !std::is_same_v<Free, detail::obj_no_free<T>>;
+
+        typename detail::Storage<T, Free>::type t_;
+
+        static UniquePtr copy(UniquePtr const & t) {
+            if constexpr (owning) {
+                return t ? t[&detail::obj_dup<T>::dup]() : nullptr;
+            } else {
+                return t.t_.get();
+            }
+        }
     };
 
 
@@ -276,279 +829,5785 @@ namespace git2pp {
         template <typename T, typename... Params, typename... Args>
         UniquePtr<T> wrap(int (*f)(T * * t, Params... params), Args &&... args) {
             T * t;
-            check(f(&t, std::forward<Args>(args)...));
+            check(call<FailsIfNegative>(f, &t, std::forward<Args>(args)...));
             return t;
         }
 
         template <typename... Params, typename... Args>
         git_oid wrapOid(int (*f)(git_oid * oid, Params... params), Args &&... args) {
             git_oid oid;
-            check(f(&oid, std::forward<Args>(args)...));
+            check(call<FailsIfNegative>(f, &oid, std::forward<Args>(args)...));
             return oid;
         }
 
-    }
-
-    class Session {
-    public:
-        Session() {
-            git_libgit2_init();
+        template <typename T, typename... Params, typename... Args>
+        Result<UniquePtr<T>> tryWrap(int (*f)(T * * t, Params... params), Args &&... args) {
+            T * t;
+            int rc = call<FailsIfNegative>(f, &t, std::forward<Args>(args)...);
+            if (rc < 0) {
+                return Result<UniquePtr<T>>::failure(rc);
+            }
+            return UniquePtr<T>{t};
         }
 
-        ~Session() {
-            git_libgit2_shutdown();
+        template <typename... Params, typename... Args>
+        Result<git_oid> tryWrapOid(int (*f)(git_oid * oid, Params... params), Args &&... args) {
+            git_oid oid;
+            int rc = call<FailsIfNegative>(f, &oid, std::forward<Args>(args)...);
+            if (rc < 0) {
+                return Result<git_oid>::failure(rc);
+            }
+            return oid;
         }
 
-        template <typename T, typename... Params>
-        auto operator[](int (* method)(T * *, Params...)) {
-            return [this, method](auto &&... args) {
-                return detail::wrap(method, std::forward<decltype(args)>(args)...);
-            };
-        }
-    };
+        template <typename T, typename Free>
+        class Try {
+        public:
+            Try(UniquePtr<T, Free> const * p) : p_{p} { }
 
-    template <typename I, typename NextF, typename Derived>
-    class IteratorBase {
-    public:
-        using git_iterator = I;
-        using next_f = NextF;
+            template <typename U, typename... Params, typename = std::enable_if<!std::is_const_v<T>>>
+            auto operator[](int (* method)(U * *, T *, Params...)) const {
+                return [p = p_, method](auto &&... args) {
+                    return tryWrap(method, &**p, std::forward<decltype(args)>(args)...);
+                };
+            }
 
-        IteratorBase(UniquePtr<I> * i, NextF next) : i_{i}, next_{std::move(next)} { }
-        IteratorBase() : i_{nullptr} {}
-        IteratorBase(IteratorBase const &) = delete;
-        IteratorBase(IteratorBase &&) = delete;
+            template <typename U, typename... Params>
+            auto operator[](int (* method)(U * *, T const *, Params...)) const {
+                return [p = p_, method](auto &&... args) {
+                    return tryWrap(method, &**p, std::forward<decltype(args)>(args)...);
+                };
+            }
 
-        bool operator==(Derived const & that) { return done() && that.done(); }
-        bool operator!=(Derived const & that) { return !(*this == that); }
+            template <typename... Params>
+            auto operator[](int (* method)(git_oid *, Params...)) const {
+                return [p = p_, method](auto &&... args) {
+                    return tryWrapOid(method, &**p, std::forward<decltype(args)>(args)...);
+                };
+            }
 
-        Derived & operator++() {
-            auto self = static_cast<Derived *>(this);
-            int rc;
-            self->increment(rc);
-            if (rc != 0) {
-                if (rc != GIT_ITEROVER) {
-                    check(rc);
-                }
-                this->i_ = nullptr;
+        private:
+            UniquePtr<T, Free> const * p_;
+        };
+
+        class SessionTry {
+        public:
+            template <typename T, typename... Params>
+            auto operator[](int (* method)(T * *, Params...)) const {
+                return [method](auto &&... args) {
+                    return tryWrap(method, std::forward<decltype(args)>(args)...);
+                };
             }
-            return *self;
-        }
+        };
 
-    protected:
-        NextF next_;
-        UniquePtr<I> * i_;
+    }
 
-    private:
-        bool done() const { return !i_; }
-    };
+    // A handle to an object owned by a Scope.
+    template <typename T>
+    using ScopedPtr = UniquePtr<T, detail::obj_no_free<T>>;
 
-    template <typename I, typename NextF, typename T, typename Free = detail::obj_free<T>>
-    class Iterator : public IteratorBase<I, NextF, Iterator<I, NextF, T, Free>> {
-    private:
-        using base = IteratorBase<I, NextF, Iterator>;
+    // Owns objects whose lifetimes end together, e.g. every entry and object
+    // touched while processing one large tree, and frees them in one pass,
+    // newest first, when it is destroyed or released. The handles adopt()
+    // returns are trivially destructible, so containers of them cost nothing
+    // to tear down. libgit2 still frees each object individually; the scope
+    // just does it from a single contiguous list.
+    class Scope {
     public:
-        Iterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
-        Iterator() = default;
+        Scope() = default;
+        Scope(Scope const &) = delete;
+        Scope & operator=(Scope const &) = delete;
+        ~Scope() { release(); }
 
-        void increment(int & rc) {
-            T * t;
-            if ((rc = base::next_(&t, &**base::i_)) == 0) {
-                t_.reset(t);
+        template <typename T, typename Free>
+        ScopedPtr<T> adopt(UniquePtr<T, Free> && p) {
+            return adopt<T, Free>(p.release());
+        }
+
+        template <typename T, typename Free = detail::obj_free<T>>
+        ScopedPtr<T> adopt(T * t) {
+            if (t) {
+                entries_.push_back({t, &free<T, Free>});
             }
+            return t;
         }
 
-        UniquePtr<T, Free> operator*() const { return std::move(t_); }
-        UniquePtr<T, Free> & operator->() const { return t_; }
+        // Frees everything adopted so far. The scope can be reused afterwards.
+        void release() {
+            for (size_t i = entries_.size(); i-- > 0;) {
+                entries_[i].free(entries_[i].object);
+            }
+            entries_.clear();
+        }
+
+        void reserve(size_t n) { entries_.reserve(n); }
+        size_t size() const { return entries_.size(); }
+
+    private:
+        struct Entry {
+            void * object;
+            void (*free)(void *);
+        };
+
+        std::vector<Entry> entries_;
+
+        template <typename T, typename Free>
+        static void free(void * t) {
+            Free{}(static_cast<T *>(t));
+        }
+    };
+
+#if LIBGIT2PP_HAVE_ALLOCATOR
+
+    // libgit2's memory use, as seen by the Allocator installed by a Session.
+    struct MemoryStats {
+        size_t liveBytes = 0;       // Requested by libgit2 and not yet freed.
+        size_t peakBytes = 0;       // Sampled, so very brief spikes can be missed.
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        double seconds = 0;         // Since the allocator was installed.
+
+        double allocationsPerSecond() const { return seconds > 0 ? double(allocations) / seconds : 0; }
+    };
+
+    // Where libgit2 gets its memory; see Session(Allocator &). Blocks must be
+    // 16-byte aligned. deallocate() and reallocate() receive the size that
+    // was asked for.
+    class Allocator {
+    public:
+        virtual ~Allocator() = default;
+
+        virtual void * allocate(size_t size) = 0;
+        virtual void deallocate(void * p, size_t size) = 0;
+
+        virtual void * reallocate(void * p, size_t oldSize, size_t newSize) {
+            void * q = allocate(newSize);
+            if (q) {
+                std::memcpy(q, p, std::min(oldSize, newSize));
+                deallocate(p, oldSize);
+            }
+            return q;
+        }
+    };
+
+    // The C library's allocator, for telemetry without changing behavior.
+    class MallocAllocator : public Allocator {
+    public:
+        void * allocate(size_t size) override { return std::malloc(size); }
+        void deallocate(void * p, size_t) override { std::free(p); }
+        void * reallocate(void * p, size_t, size_t newSize) override { return std::realloc(p, newSize); }
+    };
+
+    // Size-class pool with per-thread caches, for the small, short-lived
+    // blocks that dominate tree and commit parsing. Blocks of up to maxSmall
+    // bytes come from 64 KiB chunks and are recycled, never returned to the
+    // system; larger ones go to malloc. Each thread keeps up to cacheLimit
+    // free blocks per class without locking, sharing the rest.
+    class PoolAllocator : public Allocator {
+    public:
+        static constexpr size_t maxSmall = 1024;
+        static constexpr size_t cacheLimit = 256;
+
+        PoolAllocator() = default;
+        PoolAllocator(PoolAllocator const &) = delete;
+        PoolAllocator & operator=(PoolAllocator const &) = delete;
+
+        ~PoolAllocator() {
+            for (auto chunk : chunks_) {
+                std::free(chunk);
+            }
+        }
+
+        void * allocate(size_t size) override {
+            if (size > maxSmall) {
+                return std::malloc(size);
+            }
+            size_t c = sizeClass(size);
+            if (auto cache = threadCache()) {
+                if (!cache->heads[c]) {
+                    refill(*cache, c);
+                }
+                if (auto block = cache->heads[c]) {
+                    cache->heads[c] = block->next;
+                    --cache->counts[c];
+                    return block;
+                }
+                return nullptr;
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            return takeShared(c);
+        }
+
+        void deallocate(void * p, size_t size) override {
+            if (size > maxSmall) {
+                std::free(p);
+                return;
+            }
+            size_t c = sizeClass(size);
+            auto block = static_cast<Block *>(p);
+            if (auto cache = threadCache()) {
+                block->next = cache->heads[c];
+                cache->heads[c] = block;
+                if (++cache->counts[c] > cacheLimit) {
+                    spill(*cache, c, cacheLimit / 2);
+                }
+                return;
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            block->next = shared_[c];
+            shared_[c] = block;
+        }
+
+        void * reallocate(void * p, size_t oldSize, size_t newSize) override {
+            if (oldSize <= maxSmall && newSize <= maxSmall && sizeClass(oldSize) == sizeClass(newSize)) {
+                return p;
+            }
+            if (oldSize > maxSmall && newSize > maxSmall) {
+                return std::realloc(p, newSize);
+            }
+            return Allocator::reallocate(p, oldSize, newSize);
+        }
+
+    private:
+        static constexpr size_t granule = 16;
+        static constexpr size_t classes = maxSmall / granule;
+        static constexpr size_t chunkSize = 64 * 1024;
+        static constexpr size_t batch = 32;
+
+        struct Block {
+            Block * next;
+        };
+
+        struct Cache {
+            PoolAllocator * owner = nullptr;
+            Block * heads[classes] = {};
+            size_t counts[classes] = {};
+        };
+
+        // Returns the cache to the pool when its thread exits.
+        struct CacheGuard {
+            Cache * cache = nullptr;
+            ~CacheGuard() {
+                if (cache) {
+                    for (size_t c = 0; c < classes; ++c) {
+                        cache->owner->spill(*cache, c, cache->counts[c]);
+                    }
+                    delete cache;
+                }
+                cachePtr() = nullptr;
+                exiting() = true;
+            }
+        };
+
+        std::mutex mutex_;
+        Block * shared_[classes] = {};
+        std::vector<void *> chunks_;
+        char * carve_ = nullptr;
+        char * carveEnd_ = nullptr;
+
+        static size_t sizeClass(size_t size) { return size ? (size - 1) / granule : 0; }
+
+        static bool & exiting() {
+            static thread_local bool e = false;
+            return e;
+        }
+
+        static Cache *& cachePtr() {
+            static thread_local Cache * cache = nullptr;
+            return cache;
+        }
+
+        // This thread's cache, or null once the thread is exiting (libgit2
+        // frees its thread state late) or if the cache belongs to another pool.
+        Cache * threadCache() {
+            auto & cache = cachePtr();
+            if (!cache) {
+                if (exiting()) {
+                    return nullptr;
+                }
+                static thread_local CacheGuard guard;
+                cache = guard.cache = new Cache;
+                cache->owner = this;
+            }
+            return cache->owner == this ? cache : nullptr;
+        }
+
+        void refill(Cache & cache, size_t c) {
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (size_t i = 0; i < batch; ++i) {
+                auto block = static_cast<Block *>(takeShared(c));
+                if (!block) {
+                    break;
+                }
+                block->next = cache.heads[c];
+                cache.heads[c] = block;
+                ++cache.counts[c];
+            }
+        }
+
+        void spill(Cache & cache, size_t c, size_t n) {
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (; n && cache.heads[c]; --n) {
+                auto block = cache.heads[c];
+                cache.heads[c] = block->next;
+                --cache.counts[c];
+                block->next = shared_[c];
+                shared_[c] = block;
+            }
+        }
+
+        // Requires mutex_.
+        void * takeShared(size_t c) {
+            if (auto block = shared_[c]) {
+                shared_[c] = block->next;
+                return block;
+            }
+            size_t size = (c + 1) * granule;
+            if (size_t(carveEnd_ - carve_) < size) {
+                void * chunk = std::malloc(chunkSize);
+                if (!chunk) {
+                    return nullptr;
+                }
+                chunks_.push_back(chunk);
+                carve_ = static_cast<char *>(chunk);
+                carveEnd_ = carve_ + chunkSize;
+            }
+            void * block = carve_;
+            carve_ += size;
+            return block;
+        }
+    };
+
+    // Bump allocator for short-lived batch jobs: each thread carves blocks
+    // from its own chunk without locking, frees do nothing, and all memory
+    // goes back to the system when the allocator is destroyed. Memory use
+    // only grows, so it doesn't suit long-running processes.
+    class ArenaAllocator : public Allocator {
+    public:
+        explicit ArenaAllocator(size_t chunkSize = 1 << 20) : chunkSize_{chunkSize} { }
+        ArenaAllocator(ArenaAllocator const &) = delete;
+        ArenaAllocator & operator=(ArenaAllocator const &) = delete;
+
+        ~ArenaAllocator() {
+            for (auto chunk : chunks_) {
+                std::free(chunk);
+            }
+        }
+
+        // Total bytes obtained from the system.
+        size_t reserved() const {
+            std::lock_guard<std::mutex> lock{mutex_};
+            return reserved_;
+        }
+
+        void * allocate(size_t size) override {
+            size = (size + 15) & ~size_t(15);
+            auto & r = region();
+            if (r.owner != this || size_t(r.end - r.next) < size) {
+                if (size > chunkSize_ / 4) {
+                    return newChunk(size);
+                }
+                auto chunk = static_cast<char *>(newChunk(chunkSize_));
+                if (!chunk) {
+                    return nullptr;
+                }
+                r = {this, chunk, chunk + chunkSize_};
+            }
+            void * p = r.next;
+            r.next += size;
+            return p;
+        }
+
+        void deallocate(void *, size_t) override { }
+
+        void * reallocate(void * p, size_t oldSize, size_t newSize) override {
+            // Grow or shrink in place if p is this thread's latest block.
+            auto & r = region();
+            size_t oldRounded = (oldSize + 15) & ~size_t(15);
+            size_t newRounded = (newSize + 15) & ~size_t(15);
+            if (r.owner == this && static_cast<char *>(p) + oldRounded == r.next &&
+                newRounded <= size_t(r.end - static_cast<char *>(p))) {
+                r.next = static_cast<char *>(p) + newRounded;
+                return p;
+            }
+            return Allocator::reallocate(p, oldSize, newSize);
+        }
+
+    private:
+        struct Region {
+            ArenaAllocator * owner;
+            char * next;
+            char * end;
+        };
+
+        size_t chunkSize_;
+        mutable std::mutex mutex_;
+        std::vector<void *> chunks_;
+        size_t reserved_ = 0;
+
+        static Region & region() {
+            static thread_local Region r{nullptr, nullptr, nullptr};
+            return r;
+        }
+
+        void * newChunk(size_t size) {
+            void * chunk = std::malloc(size);
+            if (chunk) {
+                std::lock_guard<std::mutex> lock{mutex_};
+                chunks_.push_back(chunk);
+                reserved_ += size;
+            }
+            return chunk;
+        }
+    };
+
+    namespace detail {
+
+        // Telemetry counters, sharded by thread to keep allocation paths off
+        // shared cache lines. Never destroyed: libgit2 may free memory during
+        // static destruction and thread exit.
+        struct alignas(64) MemoryShard {
+            std::atomic<int64_t> live{0};
+            std::atomic<uint64_t> allocations{0};
+            std::atomic<uint64_t> frees{0};
+        };
+
+        struct MemoryState {
+            static constexpr size_t shards = 16;
+
+            Allocator * allocator = nullptr;
+            std::chrono::steady_clock::time_point start;
+            MemoryShard shard[shards];
+            std::atomic<size_t> peak{0};
+            std::atomic<size_t> nextShard{0};
+
+            size_t live() const {
+                int64_t sum = 0;
+                for (auto & s : shard) {
+                    sum += s.live.load(std::memory_order_relaxed);
+                }
+                return sum > 0 ? size_t(sum) : 0;
+            }
+
+            void samplePeak() {
+                size_t now = live();
+                size_t prev = peak.load(std::memory_order_relaxed);
+                while (now > prev && !peak.compare_exchange_weak(prev, now, std::memory_order_relaxed)) {
+                }
+            }
+        };
+
+        inline MemoryState & memoryState() {
+            static MemoryState * state = new MemoryState;
+            return *state;
+        }
+
+        inline MemoryShard & memoryShard() {
+            static thread_local size_t index = memoryState().nextShard++ % MemoryState::shards;
+            return memoryState().shard[index];
+        }
+
+        // Every block carries its size in a 16-byte header, since libgit2
+        // frees and reallocates without one.
+        constexpr size_t allocHeader = 16;
+
+        inline void * gitAlloc(size_t n) {
+            auto & state = memoryState();
+            if (n > SIZE_MAX - allocHeader) {
+                return nullptr;
+            }
+            auto p = static_cast<char *>(state.allocator->allocate(n + allocHeader));
+            if (!p) {
+                return nullptr;
+            }
+            std::memcpy(p, &n, sizeof(n));
+            auto & shard = memoryShard();
+            shard.live.fetch_add(int64_t(n), std::memory_order_relaxed);
+            if ((shard.allocations.fetch_add(1, std::memory_order_relaxed) & 255) == 0) {
+                state.samplePeak();
+            }
+            return p + allocHeader;
+        }
+
+        inline void gitFree(void * ptr) {
+            if (!ptr) {
+                return;
+            }
+            auto p = static_cast<char *>(ptr) - allocHeader;
+            size_t n;
+            std::memcpy(&n, p, sizeof(n));
+            auto & shard = memoryShard();
+            shard.live.fetch_sub(int64_t(n), std::memory_order_relaxed);
+            shard.frees.fetch_add(1, std::memory_order_relaxed);
+            memoryState().allocator->deallocate(p, n + allocHeader);
+        }
+
+        inline void * gitRealloc(void * ptr, size_t n) {
+            if (!ptr) {
+                return gitAlloc(n);
+            }
+            if (n > SIZE_MAX - allocHeader) {
+                return nullptr;
+            }
+            auto p = static_cast<char *>(ptr) - allocHeader;
+            size_t old;
+            std::memcpy(&old, p, sizeof(old));
+            auto q = static_cast<char *>(memoryState().allocator->reallocate(p, old + allocHeader, n + allocHeader));
+            if (!q) {
+                return nullptr;
+            }
+            std::memcpy(q, &n, sizeof(n));
+            memoryShard().live.fetch_add(int64_t(n) - int64_t(old), std::memory_order_relaxed);
+            return q + allocHeader;
+        }
+
+        inline bool multiplyOverflows(size_t a, size_t b, size_t & out) {
+            out = a * b;
+            return b && out / b != a;
+        }
+
+        inline char * gitStrndup(char const * s, size_t n) {
+            auto p = static_cast<char *>(gitAlloc(n + 1));
+            if (p) {
+                std::memcpy(p, s, n);
+                p[n] = '\0';
+            }
+            return p;
+        }
+
+        // libgit2 before 1.7 also routes calloc, strdup and the array
+        // variants through the allocator; fill those in where they exist.
+        template <typename A>
+        auto fillLegacyAllocator(A & a, int) -> decltype(a.gcalloc, void()) {
+            a.gcalloc = [](size_t nelem, size_t elsize, char const *, int) -> void * {
+                size_t n;
+                if (multiplyOverflows(nelem, elsize, n)) {
+                    return nullptr;
+                }
+                void * p = gitAlloc(n);
+                if (p) {
+                    std::memset(p, 0, n);
+                }
+                return p;
+            };
+            a.gstrdup = [](char const * s, char const *, int) { return gitStrndup(s, std::strlen(s)); };
+            a.gstrndup = [](char const * s, size_t n, char const *, int) {
+                auto end = static_cast<char const *>(std::memchr(s, '\0', n));
+                return gitStrndup(s, end ? size_t(end - s) : n);
+            };
+            a.gsubstrdup = [](char const * s, size_t n, char const *, int) { return gitStrndup(s, n); };
+            a.greallocarray = [](void * p, size_t nelem, size_t elsize, char const *, int) -> void * {
+                size_t n;
+                return multiplyOverflows(nelem, elsize, n) ? nullptr : gitRealloc(p, n);
+            };
+            a.gmallocarray = [](size_t nelem, size_t elsize, char const *, int) -> void * {
+                size_t n;
+                return multiplyOverflows(nelem, elsize, n) ? nullptr : gitAlloc(n);
+            };
+        }
+
+        template <typename A>
+        void fillLegacyAllocator(A &, long) { }
+
+        inline void installAllocator(Allocator & allocator) {
+            auto & state = memoryState();
+            state.allocator = &allocator;
+            state.start = std::chrono::steady_clock::now();
+            git_allocator a{};
+            a.gmalloc = [](size_t n, char const *, int) { return gitAlloc(n); };
+            a.grealloc = [](void * p, size_t n, char const *, int) { return gitRealloc(p, n); };
+            a.gfree = [](void * p) { gitFree(p); };
+            fillLegacyAllocator(a, 0);
+            check(git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &a));
+        }
+
+    }
+
+#endif
+
+    // Settings for libgit2's process-wide object cache and pack windows, as
+    // applied by Session::tune(). Start from a profile and adjust as needed.
+    struct Tuning {
+        bool caching = true;
+        size_t cacheMaxSize = 256 << 20;    // Total bytes of parsed objects kept.
+        // Objects larger than these aren't cached (0 = never cache the type).
+        size_t commitCacheLimit = 4096;
+        size_t treeCacheLimit = 4096;
+        size_t tagCacheLimit = 4096;
+        size_t blobCacheLimit = 0;
+        size_t mwindowSize = sizeof(void *) >= 8 ? size_t(1) << 30 : 32 << 20;     // Bytes per pack window.
+        size_t mwindowMappedLimit = sizeof(void *) >= 8 ? size_t(8) << 30 : 256 << 20;
+        size_t mwindowFileLimit = 0;        // Open packfiles (0 = unlimited).
+
+        // libgit2's defaults.
+        static Tuning defaults() { return {}; }
+
+        // Long-running services on large repositories: a big cache that also
+        // holds large trees and small blobs, and room to keep packs mapped,
+        // but a bound on open packs to stay clear of descriptor limits.
+        static Tuning server() {
+            Tuning t;
+            t.cacheMaxSize = size_t(1) << 30;
+            t.commitCacheLimit = 16 << 10;
+            t.treeCacheLimit = 1 << 20;
+            t.blobCacheLimit = 16 << 10;
+            if (sizeof(void *) >= 8) {
+                t.mwindowMappedLimit = size_t(32) << 30;
+            }
+            t.mwindowFileLimit = 1024;
+            return t;
+        }
+
+        // Short-lived command-line tools: most objects are read once, so a
+        // small cache holding only commits and trees.
+        static Tuning cli() {
+            Tuning t;
+            t.cacheMaxSize = 64 << 20;
+            t.treeCacheLimit = 64 << 10;
+            return t;
+        }
+
+        // Containers with tight memory limits: a small cache and small pack
+        // windows, since mapped pack pages count towards the container's RSS.
+        static Tuning lowMemory() {
+            Tuning t;
+            t.cacheMaxSize = 16 << 20;
+            t.mwindowSize = 32 << 20;
+            t.mwindowMappedLimit = 256 << 20;
+            t.mwindowFileLimit = 64;
+            return t;
+        }
+    };
+
+    // What libgit2's caches hold right now. libgit2 keeps no hit counters,
+    // but a cache sitting at its limit is evicting.
+    struct CacheStats {
+        size_t cachedBytes = 0;         // Parsed objects in the object cache.
+        size_t cacheLimit = 0;
+        size_t mwindowSize = 0;
+        size_t mwindowMappedLimit = 0;
+        size_t mwindowFileLimit = 0;
+        // Pack windows currently mapped, counted from /proc/self/maps on
+        // Linux since libgit2 doesn't export its mwindow counters. -1 elsewhere.
+        ptrdiff_t packWindows = -1;
+        ptrdiff_t packMappedBytes = -1;
+    };
+
+    class Session {
+    public:
+        Session() {
+            git_libgit2_init();
+        }
+
+        explicit Session(Tuning const & tuning) : Session{} {
+            tune(tuning);
+        }
+
+#if LIBGIT2PP_HAVE_ALLOCATOR
+        // Routes all libgit2 memory through `allocator` and turns on
+        // memoryStats(). libgit2 can't switch allocators while it holds
+        // memory, so this must be the process's first Session, created before
+        // any other libgit2 use. The allocator stays installed for good and
+        // must outlive all libgit2 activity, including threads that used
+        // libgit2 exiting; a static is simplest.
+        explicit Session(Allocator & allocator) {
+            if (git_libgit2_init() != 1 || detail::memoryState().allocator) {
+                git_libgit2_shutdown();
+                throw Error{"allocator must be installed by the first Session"};
+            }
+            git_libgit2_shutdown();
+            detail::installAllocator(allocator);
+            git_libgit2_init();
+        }
+
+        // All zeros unless an allocator was installed.
+        static MemoryStats memoryStats() {
+            MemoryStats stats;
+            auto & state = detail::memoryState();
+            if (!state.allocator) {
+                return stats;
+            }
+            state.samplePeak();
+            stats.liveBytes = state.live();
+            stats.peakBytes = std::max(stats.liveBytes, state.peak.load(std::memory_order_relaxed));
+            for (auto & shard : state.shard) {
+                stats.allocations += shard.allocations.load(std::memory_order_relaxed);
+                stats.frees += shard.frees.load(std::memory_order_relaxed);
+            }
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.start).count();
+            return stats;
+        }
+#endif
+
+        ~Session() {
+            git_libgit2_shutdown();
+        }
+
+        // Applies `tuning` process-wide. Window sizes only affect packs opened
+        // afterwards, so tune before opening repositories.
+        static void tune(Tuning const & tuning) {
+            check(git_libgit2_opts(GIT_OPT_ENABLE_CACHING, int(tuning.caching)));
+            check(git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, ssize_t(tuning.cacheMaxSize)));
+            check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_COMMIT, tuning.commitCacheLimit));
+            check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_TREE, tuning.treeCacheLimit));
+            check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_TAG, tuning.tagCacheLimit));
+            check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJ_BLOB, tuning.blobCacheLimit));
+            check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, tuning.mwindowSize));
+            check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, tuning.mwindowMappedLimit));
+#if LIBGIT2PP_HAVE_MWINDOW_FILE_LIMIT
+            check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, tuning.mwindowFileLimit));
+#endif
+        }
+
+        static CacheStats cacheStats() {
+            CacheStats stats;
+            ssize_t current = 0, allowed = 0;
+            check(git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &current, &allowed));
+            stats.cachedBytes = size_t(std::max<ssize_t>(current, 0));
+            stats.cacheLimit = size_t(std::max<ssize_t>(allowed, 0));
+            check(git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &stats.mwindowSize));
+            check(git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, &stats.mwindowMappedLimit));
+#if LIBGIT2PP_HAVE_MWINDOW_FILE_LIMIT
+            check(git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &stats.mwindowFileLimit));
+#endif
+#if defined(__linux__)
+            if (auto maps = std::fopen("/proc/self/maps", "r")) {
+                stats.packWindows = stats.packMappedBytes = 0;
+                char line[4096];
+                while (std::fgets(line, sizeof(line), maps)) {
+                    unsigned long long start, end;
+                    auto len = std::strlen(line);
+                    if (len > 6 && std::strcmp(line + len - 6, ".pack\n") == 0 &&
+                        std::sscanf(line, "%llx-%llx", &start, &end) == 2) {
+                        ++stats.packWindows;
+                        stats.packMappedBytes += ptrdiff_t(end - start);
+                    }
+                }
+                std::fclose(maps);
+            }
+#endif
+            return stats;
+        }
+
+        template <typename T, typename... Params>
+        auto operator[](int (* method)(T * *, Params...)) {
+            return [this, method](auto &&... args) {
+                return detail::wrap(method, std::forward<decltype(args)>(args)...);
+            };
+        }
+
+        // Non-throwing variant of operator[]; see UniquePtr::try_().
+        detail::SessionTry try_() const { return {}; }
+
+#if LIBGIT2PP_HAVE_COROUTINES
+        // Awaitable variant of operator[]; see UniquePtr::async().
+        detail::SessionAsync async(BlockingPool & pool, Executor * executor = nullptr) const;
+#endif
+    };
+
+    template <typename I, typename NextF, typename Derived>
+    class IteratorBase {
+    public:
+        using git_iterator = I;
+        using next_f = NextF;
+
+        IteratorBase(UniquePtr<I> * i, NextF next) : i_{i}, next_{std::move(next)} { }
+        IteratorBase() : i_{nullptr} {}
+        IteratorBase(IteratorBase const &) = delete;
+        IteratorBase(IteratorBase &&) = delete;
+
+        bool operator==(Derived const & that) { return done() && that.done(); }
+        bool operator!=(Derived const & that) { return !(*this == that); }
+
+        Derived & operator++() {
+            auto self = static_cast<Derived *>(this);
+            int rc;
+            self->increment(rc);
+            if (rc != 0) {
+                if (rc != GIT_ITEROVER) {
+                    check(rc);
+                }
+                this->i_ = nullptr;
+            }
+            return *self;
+        }
+
+    protected:
+        NextF next_;
+        UniquePtr<I> * i_;
+
+    private:
+        bool done() const { return !i_; }
+    };
+
+    template <typename I, typename NextF, typename T, typename Free = detail::obj_free<T>>
+    class Iterator : public IteratorBase<I, NextF, Iterator<I, NextF, T, Free>> {
+    private:
+        using base = IteratorBase<I, NextF, Iterator>;
+    public:
+        Iterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
+        Iterator() = default;
+
+        void increment(int & rc) {
+            T * t;
+            if ((rc = detail::call<detail::FailsUnlessIterover>(base::next_, &t, &**base::i_)) == 0) {
+                t_.reset(t);
+            }
+        }
+
+        UniquePtr<T, Free> operator*() const { return std::move(t_); }
+        UniquePtr<T, Free> & operator->() const { return t_; }
 
     private:
         mutable UniquePtr<T, Free> t_;
         friend base;
     };
 
-    template <typename I, typename NextF, typename T>
-    class StructIterator : public IteratorBase<I, NextF, StructIterator<I, NextF, T>> {
-    private:
-        using base = IteratorBase<I, NextF, StructIterator>;
+    template <typename I, typename NextF, typename T>
+    class StructIterator : public IteratorBase<I, NextF, StructIterator<I, NextF, T>> {
+    private:
+        using base = IteratorBase<I, NextF, StructIterator>;
+    public:
+        StructIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
+        StructIterator() = default;
+
+        void increment(int & rc) {
+            T t;
+            if ((rc = detail::call<detail::FailsUnlessIterover>(base::next_, &t, &**base::i_)) == 0) {
+                t_ = t;
+            }
+        }
+
+        T operator*() const { return t_; }
+        T & operator->() const { return t_; }
+
+    private:
+        mutable T t_;
+        friend base;
+    };
+
+    template <typename I, typename NextF>
+    class BranchIterator : public IteratorBase<I, NextF, BranchIterator<I, NextF>> {
+    private:
+        using base = IteratorBase<I, NextF, BranchIterator>;
+    public:
+        struct Entry {
+            Entry() = default;
+            Entry(Entry const &) = delete;
+            Entry& operator=(Entry const &) = delete;
+            Entry(Entry &&) = default;
+            Entry& operator=(Entry &&) = default;
+
+            UniquePtr<git_reference> ref;
+            git_branch_t type;
+        };
+
+        BranchIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
+        BranchIterator() = default;
+
+        void increment(int & rc) {
+            git_reference * ref;
+            git_branch_t type;
+            if ((rc = detail::call<detail::FailsUnlessIterover>(base::next_, &ref, &type, &**base::i_)) == 0) {
+                // Entry isn't an aggregate in C++20, so assign the members.
+                e_.ref = UniquePtr<git_reference>{ref};
+                e_.type = type;
+            }
+        }
+
+        Entry const & operator*() const { return e_; }
+        Entry const * operator->() const { return &e_; }
+
+    private:
+        Entry e_;
+        friend base;
+    };
+
+    template <typename I, typename NextF>
+    class IndexConflictIterator : public IteratorBase<I, NextF, IndexConflictIterator<I, NextF>> {
+    private:
+        using base = IteratorBase<I, NextF, IndexConflictIterator>;
+    public:
+        struct Entry {
+            git_index_entry const * ancestor;
+            git_index_entry const * our;
+            git_index_entry const * their;
+        };
+
+        IndexConflictIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
+        IndexConflictIterator() = default;
+
+        void increment(int & rc) {
+            Entry e;
+            if ((rc = detail::call<detail::FailsUnlessIterover>(base::next_, &e.ancestor, &e.our, &e.their, &**base::i_)) == 0) {
+                e_ = e;
+            }
+        }
+
+        Entry const & operator*() const { return e_; }
+        Entry const * operator->() const { return &e_; }
+
+    private:
+        Entry e_;
+        friend base;
+    };
+
+    template <typename I, typename NextF>
+    class NoteIterator : public IteratorBase<I, NextF, NoteIterator<I, NextF>> {
+    private:
+        using base = IteratorBase<I, NextF, NoteIterator>;
+    public:
+        struct Entry {
+            git_oid note_id;
+            git_oid annotated_id;
+        };
+
+        NoteIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
+        NoteIterator() = default;
+
+        void increment(int & rc) {
+            Entry e;
+            if ((rc = detail::call<detail::FailsUnlessIterover>(base::next_, &e.note_id, &e.annotated_id, &**base::i_)) == 0) {
+                e_ = e;
+            }
+        }
+
+        Entry const & operator*() const { return e_; }
+        Entry const * operator->() const { return &e_; }
+
+    private:
+        Entry e_;
+        friend base;
+    };
+
+    template <typename Iterator>
+    class Iterable {
+    public:
+        using iterator = Iterator;
+        using git_iterator = typename iterator::git_iterator;
+        using next_f = typename iterator::next_f;
+
+        Iterable(next_f next) : next_(std::move(next)) { }
+
+        Iterator begin() { return {static_cast<UniquePtr<git_iterator> *>(this), next_}; }
+        Iterator end() { return {}; }
+
+    private:
+        next_f next_;
+    };
+
+    namespace detail {
+
+        using ConfigIterable = Iterable<Iterator<git_config_iterator, decltype(&git_config_next), git_config_entry, obj_no_free<git_config_entry>>>;
+        template <> class MaybeIterable<UniquePtr<git_config_iterator>> : public ConfigIterable {
+        public:
+            MaybeIterable() : ConfigIterable(git_config_next) {}
+        };
+
+#if LIBGIT2PP_HAVE_INDEX_ITERATOR
+        using IndexIteratorIterable = Iterable<Iterator<git_index_iterator, decltype(&git_index_iterator_next), const git_index_entry>>;
+        template <> class MaybeIterable<UniquePtr<git_index_iterator>> : public IndexIteratorIterable {
+        public:
+            MaybeIterable() : IndexIteratorIterable(git_index_iterator_next) {}
+        };
+#endif
+
+        using ReferenceIterable = Iterable<Iterator<git_reference_iterator, decltype(&git_reference_next), git_reference>>;
+        template <> class MaybeIterable<UniquePtr<git_reference_iterator>> : public ReferenceIterable {
+        public:
+            MaybeIterable() : ReferenceIterable(git_reference_next) {}
+        };
+
+        using RebaseIterable = Iterable<StructIterator<git_rebase, decltype(&git_rebase_next), git_rebase_operation *>>;
+        template <> class MaybeIterable<UniquePtr<git_rebase>> : public RebaseIterable {
+        public:
+            MaybeIterable() : RebaseIterable(git_rebase_next) {}
+        };
+
+        using RevwalkIterable = Iterable<StructIterator<git_revwalk, decltype(&git_revwalk_next), git_oid>>;
+        template <> class MaybeIterable<UniquePtr<git_revwalk>> : public RevwalkIterable {
+        public:
+            MaybeIterable() : RevwalkIterable(git_revwalk_next) {}
+        };
+
+        using BranchIterable = Iterable<BranchIterator<git_branch_iterator, decltype(&git_branch_next)>>;
+        template <> class MaybeIterable<UniquePtr<git_branch_iterator>> : public BranchIterable {
+        public:
+            MaybeIterable() : BranchIterable(git_branch_next) {}
+        };
+
+        using IndexConflictIterable = Iterable<IndexConflictIterator<git_index_conflict_iterator, decltype(&git_index_conflict_next)>>;
+        template <> class MaybeIterable<UniquePtr<git_index_conflict_iterator>> : public IndexConflictIterable {
+        public:
+            MaybeIterable() : IndexConflictIterable(git_index_conflict_next) {}
+        };
+
+        using NoteIterable = Iterable<NoteIterator<git_note_iterator, decltype(&git_note_next)>>;
+        template <> class MaybeIterable<UniquePtr<git_note_iterator>> : public NoteIterable {
+        public:
+            MaybeIterable() : NoteIterable(git_note_next) {}
+        };
+
+    }
+
+#if LIBGIT2PP_HAVE_COROUTINES
+
+    // A lazy sequence computed by a coroutine. Range-for pulls one value at a
+    // time; leaving the loop early destroys the coroutine and everything it
+    // holds. Exceptions thrown by the coroutine surface from begin() or ++.
+    // The value (and anything it points into) is only valid until the next ++.
+    template <typename T>
+    class Generator {
+    public:
+        struct promise_type {
+            T const * value = nullptr;
+            std::exception_ptr error;
+
+            Generator get_return_object() { return Generator{handle::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_always yield_value(T const & v) noexcept {
+                value = std::addressof(v);
+                return {};
+            }
+            void return_void() { }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        using handle = std::coroutine_handle<promise_type>;
+
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = T const *;
+            using reference = T const &;
+
+            iterator() = default;
+
+            bool operator==(iterator const & that) const { return done() == that.done(); }
+            bool operator!=(iterator const & that) const { return !(*this == that); }
+
+            T const & operator*() const { return *h_.promise().value; }
+            T const * operator->() const { return h_.promise().value; }
+
+            iterator & operator++() {
+                resume(h_);
+                return *this;
+            }
+            void operator++(int) { ++*this; }
+
+        private:
+            handle h_;
+
+            explicit iterator(handle h) : h_{h} { }
+            bool done() const { return !h_ || h_.done(); }
+            friend Generator;
+        };
+
+        Generator(Generator && that) : h_{std::exchange(that.h_, nullptr)} { }
+        Generator & operator=(Generator && that) {
+            std::swap(h_, that.h_);
+            return *this;
+        }
+        ~Generator() {
+            if (h_) {
+                h_.destroy();
+            }
+        }
+
+        iterator begin() {
+            resume(h_);
+            return iterator{h_};
+        }
+        iterator end() { return {}; }
+
+    private:
+        handle h_;
+
+        explicit Generator(handle h) : h_{h} { }
+
+        static void resume(handle h) {
+            h.resume();
+            if (h.done() && h.promise().error) {
+                std::rethrow_exception(std::exchange(h.promise().error, nullptr));
+            }
+        }
+    };
+
+    namespace detail {
+
+        // Runs a callback-driven producer on a helper thread in strict
+        // alternation with the consumer, as a stackful coroutine would: only
+        // one side runs at a time, so the producer may use the consumer's
+        // libgit2 handles without locking. Values cross over in batches to
+        // amortize the thread switch. Call operator() from the libgit2
+        // callback and return its result, which becomes GIT_EUSER once the
+        // consumer has gone, to stop the underlying call early.
+        template <typename T>
+        class Baton {
+        public:
+            static constexpr size_t batchSize = 256;
+
+            explicit Baton(std::function<void(Baton &)> produce) : produce_{std::move(produce)} { }
+            Baton(Baton const &) = delete;
+            Baton & operator=(Baton const &) = delete;
+
+            ~Baton() {
+                if (thread_.joinable()) {
+                    std::unique_lock<std::mutex> lock{mutex_};
+                    if (!finished_) {
+                        cancelled_ = true;
+                        switchTo(Producer, lock);
+                    }
+                    lock.unlock();
+                    thread_.join();
+                }
+            }
+
+            // Producer side.
+            int operator()(T value) {
+                if (cancelled_) {
+                    return GIT_EUSER;
+                }
+                batch_.push_back(std::move(value));
+                if (batch_.size() == batchSize) {
+                    std::unique_lock<std::mutex> lock{mutex_};
+                    switchTo(Consumer, lock);
+                }
+                return cancelled_ ? GIT_EUSER : 0;
+            }
+
+            // Consumer side. Runs the producer until it fills a batch or
+            // returns, and swaps the batch into `out`. False once exhausted.
+            bool next(std::vector<T> & out) {
+                out.clear();
+                std::unique_lock<std::mutex> lock{mutex_};
+                if (finished_) {
+                    return false;
+                }
+                if (!thread_.joinable()) {
+                    turn_ = Producer;
+                    thread_ = std::thread{[this] { run(); }};
+                    cv_.wait(lock, [&] { return turn_ == Consumer; });
+                } else {
+                    switchTo(Producer, lock);
+                }
+                std::swap(out, batch_);
+                if (error_) {
+                    std::rethrow_exception(std::exchange(error_, nullptr));
+                }
+                return !out.empty() || !finished_;
+            }
+
+        private:
+            enum Turn { Consumer, Producer };
+
+            std::function<void(Baton &)> produce_;
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            Turn turn_ = Consumer;
+            bool cancelled_ = false;
+            bool finished_ = false;
+            std::exception_ptr error_;
+            std::vector<T> batch_;
+            std::thread thread_;
+
+            void switchTo(Turn turn, std::unique_lock<std::mutex> & lock) {
+                turn_ = turn;
+                cv_.notify_one();
+                cv_.wait(lock, [&] { return turn_ != turn; });
+            }
+
+            void run() {
+                std::exception_ptr error;
+                try {
+                    produce_(*this);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock{mutex_};
+                if (!cancelled_) {
+                    error_ = error;
+                }
+                finished_ = true;
+                turn_ = Consumer;
+                cv_.notify_one();
+            }
+        };
+
+    }
+
+    // Turns a callback-style libgit2 API into a Generator. `produce` receives
+    // a callable `yield` taking a T and returning int; call it from the
+    // libgit2 callback (passing &yield as the payload) and return its result.
+    // The call runs on a helper thread, but never concurrently with the
+    // consumer.
+    //
+    //     auto notes = git2pp::generate<git_oid>([&](auto & yield) {
+    //         git2pp::check(git_note_foreach(&*repo, nullptr,
+    //             [](git_oid const *, git_oid const * id, void * p) {
+    //                 return (*static_cast<std::remove_reference_t<decltype(yield)> *>(p))(*id);
+    //             }, &yield));
+    //     });
+    template <typename T, typename F>
+    Generator<T> generate(F produce) {
+        detail::Baton<T> baton{std::move(produce)};
+        std::vector<T> batch;
+        while (baton.next(batch)) {
+            for (auto & value : batch) {
+                co_yield value;
+            }
+        }
+    }
+
+    struct TreeWalkEntry {
+        std::string_view root;          // Path of the containing tree, e.g. "src/git/".
+        git_tree_entry const * entry;
+    };
+
+    namespace detail {
+
+        inline Generator<TreeWalkEntry> treeWalk(UniquePtr<git_tree> tree, git_treewalk_mode mode) {
+            struct Level {
+                UniquePtr<git_tree> tree;
+                size_t next;
+                size_t count;
+                size_t rootSize;
+            };
+            auto repo = git_tree_owner(&*tree);
+            std::string root;
+            std::vector<Level> stack;
+            root.reserve(256);
+            stack.reserve(16);
+            auto count = git_tree_entrycount(&*tree);
+            stack.push_back({std::move(tree), 0, count, 0});
+            while (!stack.empty()) {
+                auto & top = stack.back();
+                if (top.next == top.count) {
+                    stack.pop_back();
+                    if (mode == GIT_TREEWALK_POST && !stack.empty()) {
+                        auto & parent = stack.back();
+                        root.resize(parent.rootSize);
+                        co_yield {root, git_tree_entry_byindex(&*parent.tree, parent.next - 1)};
+                    }
+                    continue;
+                }
+                auto entry = git_tree_entry_byindex(&*top.tree, top.next++);
+                root.resize(top.rootSize);
+                if (mode == GIT_TREEWALK_PRE) {
+                    co_yield {root, entry};
+                }
+                if (git_tree_entry_type(entry) == GIT_OBJ_TREE) {
+                    auto subtree = wrap(git_tree_lookup, repo, git_tree_entry_id(entry));
+                    root.append(git_tree_entry_name(entry)).push_back('/');
+                    count = git_tree_entrycount(&*subtree);
+                    stack.push_back({std::move(subtree), 0, count, root.size()});
+                } else if (mode == GIT_TREEWALK_POST) {
+                    co_yield {root, entry};
+                }
+            }
+        }
+
+    }
+
+    // Lazy git_tree_walk. Subtrees are loaded only as the walk reaches them.
+    inline Generator<TreeWalkEntry> treeWalk(UniquePtr<git_tree> tree, git_treewalk_mode mode = GIT_TREEWALK_PRE) {
+        return detail::treeWalk(std::move(tree), mode);
+    }
+
+    // One git_diff_foreach event: a file (hunk and line null), a hunk (line
+    // null) or a line.
+    struct DiffEvent {
+        git_diff_delta const * delta;
+        git_diff_hunk const * hunk;
+        git_diff_line const * line;
+    };
+
+    namespace detail {
+
+        inline Generator<DiffEvent> diffForeach(git_diff * diff, bool hunks) {
+            for (size_t i = 0, n = git_diff_num_deltas(diff); i < n; ++i) {
+                auto delta = git_diff_get_delta(diff, i);
+                co_yield {delta, nullptr, nullptr};
+                if (!hunks) {
+                    continue;
+                }
+                auto patch = wrap(git_patch_from_diff, diff, i);
+                if (!patch) {
+                    continue;
+                }
+                for (size_t h = 0, nh = git_patch_num_hunks(&*patch); h < nh; ++h) {
+                    git_diff_hunk const * hunk;
+                    size_t lines;
+                    check(git_patch_get_hunk(&hunk, &lines, &*patch, h));
+                    co_yield {delta, hunk, nullptr};
+                    for (size_t l = 0; l < lines; ++l) {
+                        git_diff_line const * line;
+                        check(git_patch_get_line_in_hunk(&line, &*patch, h, l));
+                        co_yield {delta, hunk, line};
+                    }
+                }
+            }
+        }
+
+    }
+
+    // Lazy git_diff_foreach, in the same order as its callbacks. Patches are
+    // generated one file at a time, and only if `hunks` is set. Binary
+    // deltas yield only their file event. `diff` must outlive the generator.
+    inline Generator<DiffEvent> diffForeach(UniquePtr<git_diff> & diff, bool hunks = true) {
+        return detail::diffForeach(&*diff, hunks);
+    }
+
+    namespace detail {
+
+        inline Generator<git_status_entry const *> statusForeach(UniquePtr<git_status_list> list) {
+            for (size_t i = 0, n = git_status_list_entrycount(&*list); i < n; ++i) {
+                co_yield git_status_byindex(&*list, i);
+            }
+        }
+
+    }
+
+    // Like git_status_foreach_ext. Status is computed up front, as libgit2
+    // does for the callback version too.
+    inline Generator<git_status_entry const *> statusForeach(UniquePtr<git_repository> & repo,
+                                                             git_status_options const * opts = nullptr) {
+        return detail::statusForeach(repo[git_status_list_new](opts));
+    }
+
+    // Lazy git_odb_foreach. `odb` must outlive the generator.
+    inline Generator<git_oid> odbForeach(UniquePtr<git_odb> & odb) {
+        return generate<git_oid>([odb = &*odb](detail::Baton<git_oid> & yield) {
+            check(detail::call<detail::FailsIfNegative>(git_odb_foreach, odb, [](git_oid const * id, void * p) {
+                return (*static_cast<detail::Baton<git_oid> *>(p))(*id);
+            }, &yield));
+        });
+    }
+
+    namespace detail {
+
+        struct StringSink : git_writestream {
+            explicit StringSink(Baton<std::string> & baton) : git_writestream{}, baton{baton} {
+                write = [](git_writestream * s, char const * buffer, size_t len) {
+                    return static_cast<StringSink *>(s)->baton(std::string(buffer, len));
+                };
+                close = [](git_writestream *) { return 0; };
+                free = [](git_writestream *) { };
+            }
+
+            Baton<std::string> & baton;
+        };
+
+        inline Generator<std::string_view> blobFilter(UniquePtr<git_blob> blob, UniquePtr<git_filter_list> filters) {
+            if (!filters) {
+                co_yield blob.view();
+                co_return;
+            }
+            for (auto & chunk : generate<std::string>([&](Baton<std::string> & yield) {
+                StringSink sink{yield};
+                check(call<FailsIfNegative>(git_filter_list_stream_blob, &*filters, &*blob, &sink));
+            })) {
+                co_yield std::string_view{chunk};
+            }
+        }
+
+    }
+
+    // Streams `blob` through the filters (CRLF, ident, LFS, …) that apply to
+    // `path`, like git_blob_filter but yielding chunks as the filters write
+    // them instead of one buffer. Unfiltered blobs are yielded whole, in place.
+    inline Generator<std::string_view> blobFilter(UniquePtr<git_blob> blob, char const * path,
+                                                  git_filter_mode_t mode = GIT_FILTER_TO_WORKTREE,
+                                                  uint32_t flags = GIT_FILTER_DEFAULT) {
+        auto filters = detail::wrap(git_filter_list_load, git_blob_owner(&*blob), &*blob, path, mode, flags);
+        return detail::blobFilter(std::move(blob), std::move(filters));
+    }
+
+#endif
+
+    // Reads an object's content in chunks, for large blobs that shouldn't be
+    // held in memory whole. Loose objects stream from disk through
+    // git_odb_open_rstream, so memory stays bounded by the chunk size.
+    // Packed objects can't be streamed (libgit2 inflates and applies deltas
+    // to the whole object), so those fall back to one git_odb_read whose
+    // buffer next() then serves in place, without further copies.
+    class ObjectReader {
+    public:
+        static constexpr size_t defaultChunk = 64 * 1024;
+
+        // `odb` must outlive the reader.
+        ObjectReader(UniquePtr<git_odb> & odb, git_oid const & id, size_t chunk = defaultChunk)
+        : chunk_{chunk} {
+            open(&*odb, id);
+        }
+
+        ObjectReader(UniquePtr<git_repository> & repo, git_oid const & id, size_t chunk = defaultChunk)
+        : odb_{repo[git_repository_odb]()}, chunk_{chunk} {
+            open(&*odb_, id);
+        }
+
+        size_t size() const { return size_; }
+        git_otype type() const { return type_; }
+        size_t remaining() const { return size_ - offset_; }
+
+        // True if content comes from a stream rather than a whole-object read.
+        bool streaming() const { return bool(stream_); }
+
+        // The next chunk of at most the chunk size, valid until the next call
+        // to next() or read(). Empty at the end.
+        std::string_view next() {
+            size_t n = std::min(chunk_, remaining());
+            if (object_) {
+                std::string_view chunk{static_cast<char const *>(git_odb_object_data(&*object_)) + offset_, n};
+                offset_ += n;
+                return chunk;
+            }
+            if (!buffer_) {
+                buffer_.reset(new char[chunk_]);
+            }
+            return {buffer_.get(), read(buffer_.get(), n)};
+        }
+
+        // Copies up to n bytes into buf. Returns 0 at the end.
+        size_t read(char * buf, size_t n) {
+            n = std::min(n, remaining());
+            if (!n) {
+                return 0;
+            }
+            if (object_) {
+                std::memcpy(buf, static_cast<char const *>(git_odb_object_data(&*object_)) + offset_, n);
+                offset_ += n;
+                return n;
+            }
+            size_t done = 0;
+            while (done < n) {
+                // The stream API counts in ints.
+                size_t want = std::min<size_t>(n - done, INT_MAX);
+                int got = detail::call<detail::FailsIfNegative>(git_odb_stream_read, &*stream_, buf + done, want);
+                check(got);
+                if (got == 0) {
+                    throw Error{"object stream ended early"};
+                }
+                done += size_t(got);
+            }
+            offset_ += done;
+            return done;
+        }
+
+    private:
+        UniquePtr<git_odb> odb_;
+        UniquePtr<git_odb_stream> stream_;
+        UniquePtr<git_odb_object> object_;
+        std::unique_ptr<char[]> buffer_;
+        size_t chunk_;
+        size_t size_ = 0;
+        size_t offset_ = 0;
+        git_otype type_ = GIT_OBJ_BAD;
+
+        void open(git_odb * odb, git_oid const & id) {
+#if LIBGIT2PP_HAVE_SIZED_RSTREAM
+            git_odb_stream * stream;
+            if (detail::call<detail::FailsIfNegative>(git_odb_open_rstream, &stream, &size_, &type_, odb, &id) == 0) {
+                stream_.reset(stream);
+                return;
+            }
+#endif
+            object_ = detail::wrap(git_odb_read, odb, &id);
+            size_ = git_odb_object_size(&*object_);
+            type_ = git_odb_object_type(&*object_);
+        }
+    };
+
+    // A whole diff, materialized by one git_diff_foreach pass into flat
+    // records plus one arena holding every path, hunk header and line. The
+    // records hold offsets, and the accessors return views into the arena, so
+    // a DiffView is independent of the git_diff and repository it came from.
+    // It is immutable once built, and moves without touching the arena.
+    class DiffView {
+    public:
+        struct File {
+            std::string_view oldPath;
+            std::string_view newPath;
+            git_oid oldId;
+            git_oid newId;
+            git_delta_t status;
+            uint32_t flags;         // GIT_DIFF_FLAG_*.
+            size_t firstHunk;
+            size_t hunkCount;
+
+            bool binary() const { return flags & GIT_DIFF_FLAG_BINARY; }
+        };
+
+        struct Hunk {
+            std::string_view header;
+            int oldStart, oldLines;
+            int newStart, newLines;
+            size_t firstLine;
+            size_t lineCount;
+        };
+
+        struct Line {
+            char origin;            // GIT_DIFF_LINE_*.
+            int oldLineno;          // -1 for added lines.
+            int newLineno;          // -1 for deleted lines.
+            std::string_view content;
+        };
+
+        DiffView() = default;
+
+        explicit DiffView(UniquePtr<git_diff> const & diff) {
+            Builder b{*this, nullptr};
+            int rc = detail::call<detail::FailsIfNegative>(git_diff_foreach, &*diff, &onFile, nullptr, &onHunk, &onLine,
+                                                           static_cast<void *>(&b));
+            if (b.error) {
+                std::rethrow_exception(b.error);
+            }
+            check(rc);
+            arena_.shrink_to_fit();
+            files_.shrink_to_fit();
+            hunks_.shrink_to_fit();
+            lines_.shrink_to_fit();
+        }
+
+        size_t fileCount() const { return files_.size(); }
+        size_t hunkCount() const { return hunks_.size(); }
+        size_t lineCount() const { return lines_.size(); }
+
+        File file(size_t i) const {
+            auto & f = files_[i];
+            return {text(f.oldPath), text(f.newPath), f.oldId, f.newId, git_delta_t(f.status), f.flags, f.firstHunk, f.hunkCount};
+        }
+
+        Hunk hunk(size_t i) const {
+            auto & h = hunks_[i];
+            return {text(h.header), h.oldStart, h.oldLines, h.newStart, h.newLines, h.firstLine, h.lineCount};
+        }
+
+        Line line(size_t i) const {
+            auto & l = lines_[i];
+            return {l.origin, l.oldLineno, l.newLineno, text(l.content)};
+        }
+
+        // Bytes held, for capacity planning.
+        size_t memoryUsage() const {
+            return arena_.capacity() + files_.capacity() * sizeof(FileRecord) +
+                   hunks_.capacity() * sizeof(HunkRecord) + lines_.capacity() * sizeof(LineRecord);
+        }
+
+    private:
+        struct Text {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        struct FileRecord {
+            Text oldPath, newPath;
+            git_oid oldId, newId;
+            uint32_t status;
+            uint32_t flags;
+            uint32_t firstHunk, hunkCount;
+        };
+
+        struct HunkRecord {
+            Text header;
+            int oldStart, oldLines, newStart, newLines;
+            uint32_t firstLine, lineCount;
+        };
+
+        struct LineRecord {
+            Text content;
+            int oldLineno, newLineno;
+            char origin;
+        };
+
+        std::vector<char> arena_;
+        std::vector<FileRecord> files_;
+        std::vector<HunkRecord> hunks_;
+        std::vector<LineRecord> lines_;
+
+        std::string_view text(Text t) const { return {arena_.data() + t.offset, t.size}; }
+
+        Text store(char const * s, size_t n) {
+            if (arena_.size() + n > UINT32_MAX || hunks_.size() >= UINT32_MAX || lines_.size() >= UINT32_MAX) {
+                throw Error{"DiffView: diff too large"};
+            }
+            Text t{uint32_t(arena_.size()), uint32_t(n)};
+            arena_.insert(arena_.end(), s, s + n);
+            return t;
+        }
+
+        Text store(char const * s) { return s ? store(s, std::strlen(s)) : Text{0, 0}; }
+
+        // Exceptions can't cross libgit2's frames, so callbacks park them here.
+        struct Builder {
+            DiffView & view;
+            std::exception_ptr error;
+        };
+
+        template <typename F>
+        static int build(void * p, F && f) {
+            auto & b = *static_cast<Builder *>(p);
+            try {
+                f(b.view);
+                return 0;
+            } catch (...) {
+                b.error = std::current_exception();
+                return GIT_EUSER;
+            }
+        }
+
+        static int onFile(git_diff_delta const * delta, float, void * p) {
+            return build(p, [&](DiffView & v) {
+                v.files_.push_back({
+                    v.store(delta->old_file.path), v.store(delta->new_file.path), delta->old_file.id, delta->new_file.id,
+                    uint32_t(delta->status), delta->flags, uint32_t(v.hunks_.size()), 0});
+            });
+        }
+
+        static int onHunk(git_diff_delta const *, git_diff_hunk const * hunk, void * p) {
+            return build(p, [&](DiffView & v) {
+                v.hunks_.push_back({
+                    v.store(hunk->header, hunk->header_len), hunk->old_start, hunk->old_lines, hunk->new_start,
+                    hunk->new_lines, uint32_t(v.lines_.size()), 0});
+                ++v.files_.back().hunkCount;
+            });
+        }
+
+        static int onLine(git_diff_delta const *, git_diff_hunk const *, git_diff_line const * line, void * p) {
+            return build(p, [&](DiffView & v) {
+                v.lines_.push_back({v.store(line->content, line->content_len), line->old_lineno, line->new_lineno, line->origin});
+                ++v.hunks_.back().lineCount;
+            });
+        }
+    };
+
+    namespace detail {
+
+        // Open-addressing table keyed by git_oid, laid out like SwissTable: one
+        // control byte per slot holding a 7-bit tag of the hash, probed a group
+        // of 16 at a time. Oids are already uniformly distributed, so the
+        // hash is just the oid's leading bytes.
+        template <typename V> struct OidSlot { git_oid key; V value; };
+        template <> struct OidSlot<void> { git_oid key; };
+
+        template <typename V>
+        class OidTable {
+        public:
+            using slot_type = OidSlot<V>;
+
+            OidTable() = default;
+            OidTable(OidTable const & that) { *this = that; }
+            OidTable(OidTable && that) noexcept { *this = std::move(that); }
+
+            OidTable & operator=(OidTable const & that) {
+                if (this != &that) {
+                    clear();
+                    reserve(that.size_);
+                    for (auto & slot : that) {
+                        new (insertSlot(slot.key)) slot_type(slot);
+                        ++size_;
+                    }
+                }
+                return *this;
+            }
+
+            OidTable & operator=(OidTable && that) noexcept {
+                if (this != &that) {
+                    destroy();
+                    ctrl_ = std::move(that.ctrl_);
+                    slots_ = std::move(that.slots_);
+                    capacity_ = that.capacity_;
+                    size_ = that.size_;
+                    used_ = that.used_;
+                    that.capacity_ = that.size_ = that.used_ = 0;
+                }
+                return *this;
+            }
+
+            ~OidTable() { destroy(); }
+
+            size_t size() const { return size_; }
+            bool empty() const { return !size_; }
+
+            void clear() {
+                destroy();
+                ctrl_.reset();
+                slots_.reset();
+                capacity_ = size_ = used_ = 0;
+            }
+
+            void reserve(size_t n) {
+                size_t capacity = Group;
+                while (capacity * 7 / 8 < n) {
+                    capacity *= 2;
+                }
+                if (capacity > capacity_) {
+                    rehash(capacity);
+                }
+            }
+
+            slot_type * find(git_oid const & key) const {
+                if (!capacity_) {
+                    return nullptr;
+                }
+                uint64_t h = hash(key);
+                uint8_t tag = h & 0x7f;
+                size_t groups = capacity_ / Group;
+                for (size_t g = (h >> 7) & (groups - 1);; g = (g + 1) & (groups - 1)) {
+                    uint8_t const * ctrl = &ctrl_[g * Group];
+                    for (uint32_t m = match(ctrl, tag); m; m &= m - 1) {
+                        auto & slot = slot_at(g * Group + ctz(m));
+                        if (std::memcmp(slot.key.id, key.id, sizeof(key.id)) == 0) {
+                            return &slot;
+                        }
+                    }
+                    if (match(ctrl, Empty)) {
+                        return nullptr;
+                    }
+                }
+            }
+
+            // Returns the slot for key and whether it was newly created. New
+            // slots have their key set and their value default-constructed.
+            std::pair<slot_type *, bool> emplace(git_oid const & key) {
+                if (auto slot = find(key)) {
+                    return {slot, false};
+                }
+                if ((used_ + 1) * 8 > capacity_ * 7) {
+                    // Grow unless most of the load is tombstones, which a same-size rehash clears.
+                    rehash((size_ + 1) * 16 > capacity_ * 7 ? std::max(capacity_ * 2, Group) : capacity_);
+                }
+                auto slot = insertSlot(key);
+                new (slot) slot_type{key};
+                ++size_;
+                return {slot, true};
+            }
+
+            bool erase(git_oid const & key) {
+                auto slot = find(key);
+                if (!slot) {
+                    return false;
+                }
+                size_t i = slot - &slot_at(0);
+                slot->~slot_type();
+                ctrl_[i] = Deleted;
+                --size_;
+                return true;
+            }
+
+            class iterator {
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = slot_type;
+                using difference_type = std::ptrdiff_t;
+                using pointer = slot_type *;
+                using reference = slot_type &;
+
+                iterator(OidTable const * t, size_t i) : t_{t}, i_{i} { skip(); }
+
+                slot_type & operator*() const { return t_->slot_at(i_); }
+                slot_type * operator->() const { return &t_->slot_at(i_); }
+                iterator & operator++() { ++i_; skip(); return *this; }
+                bool operator==(iterator const & that) const { return i_ == that.i_; }
+                bool operator!=(iterator const & that) const { return i_ != that.i_; }
+
+            private:
+                OidTable const * t_;
+                size_t i_;
+
+                void skip() {
+                    while (i_ < t_->capacity_ && t_->ctrl_[i_] & 0x80) {
+                        ++i_;
+                    }
+                }
+            };
+
+            iterator begin() const { return {this, 0}; }
+            iterator end() const { return {this, capacity_}; }
+
+        private:
+            static constexpr size_t Group = 16;
+            static constexpr uint8_t Empty = 0x80;
+            static constexpr uint8_t Deleted = 0xfe;
+
+            struct alignas(slot_type) Storage {
+                unsigned char bytes[sizeof(slot_type)];
+            };
+
+            std::unique_ptr<uint8_t[]> ctrl_;
+            std::unique_ptr<Storage[]> slots_;
+            size_t capacity_ = 0;
+            size_t size_ = 0;
+            size_t used_ = 0;       // Live plus deleted slots.
+
+            static uint64_t hash(git_oid const & key) {
+                uint64_t h;
+                std::memcpy(&h, key.id, sizeof(h));
+                return h;
+            }
+
+            // Index of m's lowest set bit; m is nonzero.
+            static unsigned ctz(uint32_t m) {
+#if defined(__cpp_lib_bitops)
+                return unsigned(std::countr_zero(m));
+#elif defined(_MSC_VER)
+                unsigned long i;
+                _BitScanForward(&i, m);
+                return unsigned(i);
+#else
+                return unsigned(__builtin_ctz(m));
+#endif
+            }
+
+            // Bitmask of the group's control bytes equal to b.
+            static uint32_t match(uint8_t const * ctrl, uint8_t b) {
+#if defined(__SSE2__)
+                __m128i group = _mm_loadu_si128(reinterpret_cast<__m128i const *>(ctrl));
+                return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(char(b)))));
+#else
+                uint32_t m = 0;
+                for (size_t i = 0; i < Group; ++i) {
+                    m |= uint32_t(ctrl[i] == b) << i;
+                }
+                return m;
+#endif
+            }
+
+            slot_type & slot_at(size_t i) const { return *reinterpret_cast<slot_type *>(&slots_[i]); }
+
+            // First empty or deleted slot on key's probe sequence. Requires room.
+            slot_type * insertSlot(git_oid const & key) {
+                uint64_t h = hash(key);
+                size_t groups = capacity_ / Group;
+                for (size_t g = (h >> 7) & (groups - 1);; g = (g + 1) & (groups - 1)) {
+                    uint8_t * ctrl = &ctrl_[g * Group];
+                    if (uint32_t m = match(ctrl, Empty) | match(ctrl, Deleted)) {
+                        size_t i = g * Group + ctz(m);
+                        used_ += ctrl_[i] == Empty;
+                        ctrl_[i] = h & 0x7f;
+                        return &slot_at(i);
+                    }
+                }
+            }
+
+            void rehash(size_t capacity) {
+                OidTable old{std::move(*this)};
+                ctrl_.reset(new uint8_t[capacity]);
+                std::memset(ctrl_.get(), Empty, capacity);
+                slots_.reset(new Storage[capacity]);
+                capacity_ = capacity;
+                for (auto & slot : old) {
+                    new (insertSlot(slot.key)) slot_type(std::move(slot));
+                    ++size_;
+                }
+            }
+
+            void destroy() {
+                if (!std::is_trivially_destructible_v<slot_type>) {
+                    for (auto & slot : *this) {
+                        slot.~slot_type();
+                    }
+                }
+            }
+        };
+
+    }
+
+    // Set of oids. Accepts the git_oid values yielded by revwalks and wrapOid
+    // as well as the git_oid const * returned by accessors like git_commit_id.
+    class OidSet {
+    public:
+        class iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = git_oid;
+            using difference_type = std::ptrdiff_t;
+            using pointer = git_oid const *;
+            using reference = git_oid const &;
+
+            iterator(detail::OidTable<void>::iterator i) : i_{i} { }
+
+            git_oid const & operator*() const { return i_->key; }
+            git_oid const * operator->() const { return &i_->key; }
+            iterator & operator++() { ++i_; return *this; }
+            bool operator==(iterator const & that) const { return i_ == that.i_; }
+            bool operator!=(iterator const & that) const { return i_ != that.i_; }
+
+        private:
+            detail::OidTable<void>::iterator i_;
+        };
+
+        size_t size() const { return t_.size(); }
+        bool empty() const { return t_.empty(); }
+        void clear() { t_.clear(); }
+        void reserve(size_t n) { t_.reserve(n); }
+
+        // Returns true if oid was not already present.
+        bool insert(git_oid const & oid) { return t_.emplace(oid).second; }
+        bool insert(git_oid const * oid) { return insert(*oid); }
+
+        template <typename Range>
+        void insertAll(Range && oids) {
+            for (auto && oid : oids) {
+                insert(oid);
+            }
+        }
+
+        bool contains(git_oid const & oid) const { return t_.find(oid); }
+        bool contains(git_oid const * oid) const { return contains(*oid); }
+
+        bool erase(git_oid const & oid) { return t_.erase(oid); }
+        bool erase(git_oid const * oid) { return erase(*oid); }
+
+        iterator begin() const { return t_.begin(); }
+        iterator end() const { return t_.end(); }
+
+    private:
+        detail::OidTable<void> t_;
+    };
+
+    // Map from oid to V. Iteration yields slots with .key and .value members,
+    // so `for (auto & [oid, v] : map)` works.
+    template <typename V>
+    class OidMap {
+    public:
+        using iterator = typename detail::OidTable<V>::iterator;
+
+        size_t size() const { return t_.size(); }
+        bool empty() const { return t_.empty(); }
+        void clear() { t_.clear(); }
+        void reserve(size_t n) { t_.reserve(n); }
+
+        V & operator[](git_oid const & oid) { return t_.emplace(oid).first->value; }
+        V & operator[](git_oid const * oid) { return (*this)[*oid]; }
+
+        // Returns the value and whether it was inserted. Leaves an existing value as is.
+        std::pair<V *, bool> insert(git_oid const & oid, V value) {
+            auto r = t_.emplace(oid);
+            if (r.second) {
+                r.first->value = std::move(value);
+            }
+            return {&r.first->value, r.second};
+        }
+        std::pair<V *, bool> insert(git_oid const * oid, V value) { return insert(*oid, std::move(value)); }
+
+        // Null if absent.
+        V * find(git_oid const & oid) {
+            auto slot = t_.find(oid);
+            return slot ? &slot->value : nullptr;
+        }
+        V const * find(git_oid const & oid) const {
+            auto slot = t_.find(oid);
+            return slot ? &slot->value : nullptr;
+        }
+        V * find(git_oid const * oid) { return find(*oid); }
+        V const * find(git_oid const * oid) const { return find(*oid); }
+
+        bool contains(git_oid const & oid) const { return t_.find(oid); }
+        bool contains(git_oid const * oid) const { return contains(*oid); }
+
+        bool erase(git_oid const & oid) { return t_.erase(oid); }
+        bool erase(git_oid const * oid) { return erase(*oid); }
+
+        iterator begin() const { return t_.begin(); }
+        iterator end() const { return t_.end(); }
+
+    private:
+        detail::OidTable<V> t_;
+    };
+
+
+    // A fixed set of handles to one repository, opened up front with their
+    // config and odb (pack list included) loaded, so that leasing never pays
+    // repository-open cost. libgit2 handles must not be used
+    // by two threads at once; a Lease grants exclusive use until it is
+    // destroyed. Threads get back the handle they last used when it's free, so
+    // its caches stay warm. With libgit2 >= 1.2, whose git_odb is thread-safe,
+    // all handles share one odb (and hence one set of open packfiles).
+    class RepositoryPool {
+    public:
+        class Lease {
+        public:
+            Lease(Lease && that) : pool_{that.pool_}, slot_{that.slot_} { that.pool_ = nullptr; }
+            Lease & operator=(Lease && that) {
+                if (this != &that) {
+                    release();
+                    pool_ = that.pool_;
+                    slot_ = that.slot_;
+                    that.pool_ = nullptr;
+                }
+                return *this;
+            }
+            ~Lease() { release(); }
+
+            UniquePtr<git_repository> & operator*() const { return pool_->repos_[slot_]; }
+            UniquePtr<git_repository> * operator->() const { return &pool_->repos_[slot_]; }
+
+            template <typename F>
+            auto operator[](F method) const { return pool_->repos_[slot_][method]; }
+
+            // Returns the handle to the pool early.
+            void release() {
+                if (pool_) {
+                    pool_->giveBack(slot_);
+                    pool_ = nullptr;
+                }
+            }
+
+        private:
+            friend class RepositoryPool;
+
+            Lease(RepositoryPool * pool, size_t slot) : pool_{pool}, slot_{slot} { }
+
+            RepositoryPool * pool_;
+            size_t slot_;
+        };
+
+        RepositoryPool(Session & git2, std::string const & path,
+                       size_t size = std::thread::hardware_concurrency(),
+                       unsigned int flags = 0, char const * ceiling_dirs = nullptr) {
+            size = size ? size : 1;
+            repos_.reserve(size);
+            free_.reserve(size);
+            for (size_t i = 0; i < size; ++i) {
+                repos_.push_back(git2[git_repository_open_ext](path.c_str(), flags, ceiling_dirs));
+                // Both are otherwise loaded by the handle's first request.
+                repos_[i][git_repository_config]();
+#if LIBGIT2PP_HAVE_THREADSAFE_ODB
+                if (i == 0) {
+                    odb_ = repos_[0][git_repository_odb]();
+                    check(odb_[git_odb_refresh]());
+                } else {
+                    check(repos_[i][git_repository_set_odb](&*odb_));
+                }
+#else
+                check(repos_[i][git_repository_odb]()[git_odb_refresh]());
+#endif
+                free_.push_back(size - 1 - i);
+            }
+        }
+
+        RepositoryPool(RepositoryPool const &) = delete;
+        RepositoryPool & operator=(RepositoryPool const &) = delete;
+
+        size_t size() const { return repos_.size(); }
+
+        // The shared odb, or null if handles each have their own.
+        UniquePtr<git_odb> const & odb() const { return odb_; }
+
+        // Blocks until a handle is free.
+        Lease lease() {
+            std::unique_lock<std::mutex> lock{mutex_};
+            available_.wait(lock, [&] { return !free_.empty(); });
+            return {this, take()};
+        }
+
+        // Returns nullopt instead of blocking if no handle is free.
+        std::optional<Lease> tryLease() {
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (free_.empty()) {
+                return std::nullopt;
+            }
+            return Lease{this, take()};
+        }
+
+    private:
+        std::vector<UniquePtr<git_repository>> repos_;
+        UniquePtr<git_odb> odb_;
+        std::vector<size_t> free_;
+        std::mutex mutex_;
+        std::condition_variable available_;
+
+        struct Affinity {
+            RepositoryPool const * pool;
+            size_t slot;
+        };
+
+        static Affinity & affinity() {
+            static thread_local Affinity a{nullptr, 0};
+            return a;
+        }
+
+        // Requires mutex_.
+        size_t take() {
+            auto & a = affinity();
+            auto pick = free_.end() - 1;
+            if (a.pool == this) {
+                for (auto i = free_.begin(); i != free_.end(); ++i) {
+                    if (*i == a.slot) {
+                        pick = i;
+                        break;
+                    }
+                }
+            }
+            size_t slot = *pick;
+            free_.erase(pick);
+            a = {this, slot};
+            return slot;
+        }
+
+        void giveBack(size_t slot) {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                free_.push_back(slot);
+            }
+            available_.notify_one();
+        }
+    };
+
+
+    // Work-stealing thread pool. Each worker owns a deque: it pops its own
+    // newest task first and, when empty, steals the oldest task of a sibling.
+    // Tasks submitted from outside the pool are dealt round-robin.
+    class ThreadPool {
+    public:
+        explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+            threads = threads ? threads : 1;
+            for (size_t i = 0; i < threads; ++i) {
+                queues_.emplace_back(new Queue);
+            }
+            for (size_t i = 0; i < threads; ++i) {
+                threads_.emplace_back([this, i] { run(i); });
+            }
+        }
+
+        ThreadPool(ThreadPool const &) = delete;
+        ThreadPool & operator=(ThreadPool const &) = delete;
+
+        // Finishes queued tasks, then joins the workers.
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (auto & t : threads_) {
+                t.join();
+            }
+        }
+
+        size_t size() const { return threads_.size(); }
+
+        // Tasks must not throw; use parallelFor() for exception propagation.
+        void submit(std::function<void()> task) {
+            size_t self = self_().pool == this ? self_().index : next_++ % queues_.size();
+            {
+                std::lock_guard<std::mutex> lock{queues_[self]->mutex};
+                queues_[self]->tasks.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                ++queued_;
+            }
+            wake_.notify_one();
+        }
+
+        // Calls f(i) for i in [0, n) across the pool and returns when all calls
+        // have finished, rethrowing the first exception thrown by any of them.
+        // The calling thread runs queued tasks while it waits, so nested use
+        // from inside a task doesn't deadlock.
+        template <typename F>
+        void parallelFor(size_t n, F && f) {
+            struct Group {
+                size_t remaining;
+                std::mutex mutex;
+                std::condition_variable done;
+                std::exception_ptr error;
+            } group;
+            group.remaining = n;
+            for (size_t i = 0; i < n; ++i) {
+                submit([&group, &f, i] {
+                    std::exception_ptr error;
+                    try {
+                        f(i);
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                    // Signal under the lock: the caller may destroy group as
+                    // soon as it observes remaining == 0.
+                    std::lock_guard<std::mutex> lock{group.mutex};
+                    if (error && !group.error) {
+                        group.error = error;
+                    }
+                    if (--group.remaining == 0) {
+                        group.done.notify_all();
+                    }
+                });
+            }
+            // Help drain the queue; once it is empty, every task of ours is
+            // running on a worker, so block until the last one finishes.
+            while (runOne()) {
+            }
+            {
+                std::unique_lock<std::mutex> lock{group.mutex};
+                group.done.wait(lock, [&] { return !group.remaining; });
+            }
+            if (group.error) {
+                std::rethrow_exception(group.error);
+            }
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        struct Self {
+            ThreadPool * pool;
+            size_t index;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        size_t queued_ = 0;
+        bool stop_ = false;
+        std::atomic<size_t> next_{0};
+
+        static Self & self_() {
+            static thread_local Self self{nullptr, 0};
+            return self;
+        }
+
+        bool pop(size_t home, std::function<void()> & task) {
+            for (size_t k = 0; k < queues_.size(); ++k) {
+                auto & q = *queues_[(home + k) % queues_.size()];
+                std::lock_guard<std::mutex> lock{q.mutex};
+                if (!q.tasks.empty()) {
+                    if (k == 0) {
+                        task = std::move(q.tasks.back());
+                        q.tasks.pop_back();
+                    } else {
+                        task = std::move(q.tasks.front());
+                        q.tasks.pop_front();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool runOne() {
+            std::function<void()> task;
+            size_t home = self_().pool == this ? self_().index : 0;
+            if (!pop(home, task)) {
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                --queued_;
+            }
+            task();
+            return true;
+        }
+
+        void run(size_t index) {
+            self_() = {this, index};
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock{mutex_};
+                    wake_.wait(lock, [&] { return queued_ || stop_; });
+                    if (!queued_ && stop_) {
+                        return;
+                    }
+                }
+                runOne();
+            }
+        }
+    };
+
+
+#if LIBGIT2PP_HAVE_COROUTINES
+
+    // Where a coroutine continues after an awaited call: post() must arrange
+    // for f to run on the executor (an event loop, say) and return promptly.
+    class Executor {
+    public:
+        virtual ~Executor() = default;
+
+        virtual void post(std::function<void()> f) = 0;
+    };
+
+    // Runs libgit2 calls for coroutines on a ThreadPool reserved for blocking
+    // work, so that event loop threads never wait on disk or inflation. A
+    // handle may only be used by one thread at a time, so calls are queued
+    // per handle and run one after another, in the order they were made;
+    // calls on different handles run in parallel. Session calls have no
+    // handle and are never queued.
+    class BlockingPool {
+    public:
+        explicit BlockingPool(ThreadPool & threads) : threads_{threads} { }
+
+        BlockingPool(BlockingPool const &) = delete;
+        BlockingPool & operator=(BlockingPool const &) = delete;
+
+        // Runs f on the pool once earlier calls for `handle` have finished.
+        // f must not throw.
+        void run(void const * handle, std::function<void()> f) {
+            if (!handle) {
+                threads_.submit(std::move(f));
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                auto & queue = queues_[handle];
+                queue.push_back(std::move(f));
+                if (queue.size() > 1) {
+                    return;
+                }
+            }
+            submitFront(handle);
+        }
+
+    private:
+        ThreadPool & threads_;
+        std::mutex mutex_;
+        // The front entry of each queue is running.
+        std::unordered_map<void const *, std::deque<std::function<void()>>> queues_;
+
+        void submitFront(void const * handle) {
+            std::function<void()> * f;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                f = &queues_[handle].front();
+            }
+            threads_.submit([this, handle, f] {
+                (*f)();
+                bool more;
+                {
+                    std::lock_guard<std::mutex> lock{mutex_};
+                    auto i = queues_.find(handle);
+                    i->second.pop_front();
+                    more = !i->second.empty();
+                    if (!more) {
+                        queues_.erase(i);
+                    }
+                }
+                if (more) {
+                    submitFront(handle);
+                }
+            });
+        }
+    };
+
+    // The result of an async() call: co_await it for the call's result. The
+    // call is started by co_await, not before, and the awaiting coroutine
+    // resumes on the executor given to async(), or on the pool thread if none.
+    template <typename F>
+    class Awaitable {
+    public:
+        using value_type = decltype(std::declval<F &>()());
+
+        Awaitable(BlockingPool & pool, Executor * executor, void const * handle, F f)
+        : pool_{pool}, executor_{executor}, handle_{handle}, f_{std::move(f)} { }
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            pool_.run(handle_, [this, h] {
+                try {
+                    if constexpr (std::is_void_v<value_type>) {
+                        f_();
+                    } else {
+                        result_.emplace(f_());
+                    }
+                } catch (...) {
+                    error_ = std::current_exception();
+                }
+                if (executor_) {
+                    executor_->post([h] { h.resume(); });
+                } else {
+                    h.resume();
+                }
+            });
+        }
+
+        value_type await_resume() {
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+            if constexpr (!std::is_void_v<value_type>) {
+                return std::move(*result_);
+            }
+        }
+
+    private:
+        BlockingPool & pool_;
+        Executor * executor_;
+        void const * handle_;
+        F f_;
+        std::optional<std::conditional_t<std::is_void_v<value_type>, char, value_type>> result_;
+        std::exception_ptr error_;
+    };
+
+    namespace detail {
+
+        // Arguments are copied into the awaitable, since the call happens
+        // later on another thread; whatever they point to must outlive the
+        // co_await, as it does when they point into the awaiting coroutine.
+        template <typename T, typename Free>
+        class Async {
+        public:
+            Async(UniquePtr<T, Free> const * p, BlockingPool * pool, Executor * executor)
+            : p_{p}, pool_{pool}, executor_{executor} { }
+
+            template <typename U, typename... Params, typename = std::enable_if<!std::is_const_v<T>>>
+            auto operator[](int (* method)(U * *, T *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    return make([p = p_, method, args...] { return wrap(method, &**p, args...); });
+                };
+            }
+
+            template <typename U, typename... Params>
+            auto operator[](int (* method)(U * *, T const *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    return make([p = p_, method, args...] { return wrap(method, &**p, args...); });
+                };
+            }
+
+            template <typename R, typename... Params>
+            auto operator[](R (* method)(git_oid *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    return make([p = p_, method, args...] { return wrapOid(method, &**p, args...); });
+                };
+            }
+
+            template <typename R, typename... Params, typename = std::enable_if<!std::is_const_v<T>>>
+            auto operator[](R (* method)(T *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    return make([p = p_, method, args...] { return call<NeverFails>(method, &**p, args...); });
+                };
+            }
+
+            template <typename R, typename... Params>
+            auto operator[](R (* method)(T const *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    return make([p = p_, method, args...] { return call<NeverFails>(method, &**p, args...); });
+                };
+            }
+
+        private:
+            UniquePtr<T, Free> const * p_;
+            BlockingPool * pool_;
+            Executor * executor_;
+
+            template <typename F>
+            Awaitable<F> make(F f) const { return {*pool_, executor_, p_->template as<T>(), std::move(f)}; }
+        };
+
+        class SessionAsync {
+        public:
+            SessionAsync(BlockingPool * pool, Executor * executor) : pool_{pool}, executor_{executor} { }
+
+            template <typename T, typename... Params>
+            auto operator[](int (* method)(T * *, Params...)) const {
+                return [*this, method](auto &&... args) {
+                    auto f = [method, args...] { return wrap(method, args...); };
+                    return Awaitable<decltype(f)>{*pool_, executor_, nullptr, std::move(f)};
+                };
+            }
+
+        private:
+            BlockingPool * pool_;
+            Executor * executor_;
+        };
+
+    }
+
+    inline detail::SessionAsync Session::async(BlockingPool & pool, Executor * executor) const {
+        return {&pool, executor};
+    }
+
+#endif
+
+
+    // A commit decoded by parallelRevwalk(). Strings and parents point into the
+    // CommitBatch that holds it.
+    struct CommitInfo {
+        git_oid id;
+        git_oid tree;
+        git_time_t time;            // Committer time.
+        int offset;                 // Committer time zone offset, in minutes.
+        git_time_t authorTime;
+        std::string_view authorName;
+        std::string_view authorEmail;
+        git_oid const * parents;
+        unsigned int parentCount;
+    };
+
+    // A contiguous run of the walk, decoded on one worker. Movable; moving
+    // keeps the CommitInfo pointers valid.
+    struct CommitBatch {
+        size_t first = 0;           // Walk position of commits[0].
+        std::vector<CommitInfo> commits;
+        std::vector<git_oid> parents;
+        std::vector<char> strings;
+    };
+
+    namespace detail {
+
+        inline void decodeCommits(UniquePtr<git_repository> const & repo, std::vector<git_oid> const & oids, CommitBatch & batch) {
+            struct Offsets {
+                size_t parents, name, nameLen, email, emailLen;
+            };
+            std::vector<Offsets> offsets;
+            offsets.reserve(oids.size());
+            batch.commits.reserve(oids.size());
+            for (auto & oid : oids) {
+                auto commit = repo[git_commit_lookup](&oid);
+                auto author = commit[git_commit_author]();
+                Offsets o;
+                o.parents = batch.parents.size();
+                unsigned int n = commit[git_commit_parentcount]();
+                for (unsigned int i = 0; i < n; ++i) {
+                    batch.parents.push_back(*commit[git_commit_parent_id](i));
+                }
+                std::string_view name{author->name}, email{author->email};
+                o.name = batch.strings.size();
+                o.nameLen = name.size();
+                batch.strings.insert(batch.strings.end(), name.begin(), name.end());
+                o.email = batch.strings.size();
+                o.emailLen = email.size();
+                batch.strings.insert(batch.strings.end(), email.begin(), email.end());
+                offsets.push_back(o);
+                batch.commits.push_back({
+                    oid, *commit[git_commit_tree_id](), commit[git_commit_time](), commit[git_commit_time_offset](),
+                    author->when.time, {}, {}, nullptr, n});
+            }
+            // The arenas are complete, so pointers into them are now stable.
+            for (size_t i = 0; i < offsets.size(); ++i) {
+                auto & c = batch.commits[i];
+                auto & o = offsets[i];
+                c.authorName = {batch.strings.data() + o.name, o.nameLen};
+                c.authorEmail = {batch.strings.data() + o.email, o.emailLen};
+                c.parents = batch.parents.data() + o.parents;
+            }
+        }
+
+    }
+
+    struct ParallelRevwalkOptions {
+        size_t batchSize = 4096;    // Oids per batch.
+        size_t maxInFlight = 0;     // Batches decoding at once; 0 = 2 * threads.
+    };
+
+    // Drains `walk` on the calling thread into fixed-size oid batches, decodes
+    // each batch on `threads` using a handle leased from `repos`, and calls
+    // consume(CommitBatch &&) on the calling thread in walk order. At most
+    // maxInFlight batches are held at a time, bounding memory on huge walks.
+    template <typename F>
+    void parallelRevwalk(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_revwalk> & walk,
+                         F && consume, ParallelRevwalkOptions const & opts = {}) {
+        struct Slot {
+            CommitBatch batch;
+            bool done = false;
+            std::exception_ptr error;
+        };
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::shared_ptr<Slot>> pending;
+        size_t batchSize = opts.batchSize ? opts.batchSize : 1;
+        size_t maxInFlight = opts.maxInFlight ? opts.maxInFlight : 2 * threads.size();
+
+        auto consumeFront = [&] {
+            auto slot = pending.front();
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [&] { return slot->done; });
+            }
+            pending.pop_front();
+            if (slot->error) {
+                std::rethrow_exception(slot->error);
+            }
+            consume(std::move(slot->batch));
+        };
+
+        // Outstanding tasks reference the locals above, so wait them out even
+        // if consume() throws.
+        struct Drain {
+            std::deque<std::shared_ptr<Slot>> & pending;
+            std::mutex & mutex;
+            std::condition_variable & ready;
+            ~Drain() {
+                std::unique_lock<std::mutex> lock{mutex};
+                for (auto & slot : pending) {
+                    ready.wait(lock, [&] { return slot->done; });
+                }
+            }
+        } drain{pending, mutex, ready};
+
+        size_t position = 0;
+        auto it = walk.begin();
+        auto end = walk.end();
+        while (it != end) {
+            auto oids = std::make_shared<std::vector<git_oid>>();
+            oids->reserve(batchSize);
+            for (; it != end && oids->size() < batchSize; ++it) {
+                oids->push_back(*it);
+            }
+            auto slot = std::make_shared<Slot>();
+            slot->batch.first = position;
+            position += oids->size();
+            pending.push_back(slot);
+            threads.submit([&repos, &mutex, &ready, slot, oids] {
+                try {
+                    auto repo = repos.lease();
+                    detail::decodeCommits(*repo, *oids, slot->batch);
+                } catch (...) {
+                    slot->error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock{mutex};
+                slot->done = true;
+                ready.notify_all();
+            });
+            while (pending.size() >= maxInFlight) {
+                consumeFront();
+            }
+        }
+        while (!pending.empty()) {
+            consumeFront();
+        }
+    }
+
+    class CommitGraph;
+
+    namespace detail {
+
+        // Read-only bytes, either heap-allocated or memory-mapped from a file.
+        struct Mapping {
+            std::shared_ptr<void const> owner;
+            void const * data = nullptr;
+            size_t size = 0;
+        };
+
+        inline Mapping mapFile(std::string const & path) {
+#if !defined(_WIN32)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw Error{"can't open " + path};
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw Error{"can't stat " + path};
+            }
+            size_t size = size_t(st.st_size);
+            void * data = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                throw Error{"can't map " + path};
+            }
+            return {std::shared_ptr<void const>(data, [size](void const * p) { if (p) ::munmap(const_cast<void *>(p), size); }), data, size};
+#else
+            // No mmap; read the whole file instead.
+            std::unique_ptr<FILE, int (*)(FILE *)> f{std::fopen(path.c_str(), "rb"), &std::fclose};
+            if (!f) {
+                throw Error{"can't open " + path};
+            }
+            std::fseek(f.get(), 0, SEEK_END);
+            size_t size = size_t(std::ftell(f.get()));
+            std::fseek(f.get(), 0, SEEK_SET);
+            std::shared_ptr<char> data(new char[size ? size : 1], std::default_delete<char[]>());
+            if (std::fread(data.get(), 1, size, f.get()) != size) {
+                throw Error{"can't read " + path};
+            }
+            return {std::shared_ptr<void const>(data, data.get()), data.get(), size};
+#endif
+        }
+
+        // On-disk layout of a CommitGraph: a 64-byte header, then the arrays,
+        // each 8-byte aligned, in native byte order.
+        struct CommitGraphLayout {
+            static constexpr char magic[8] = {'G', '2', 'P', 'P', 'C', 'G', 'R', 'F'};
+            static constexpr uint32_t byteOrder = 0x01020304;
+            static constexpr uint32_t version = 1;
+            static constexpr size_t headerSize = 64;
+
+            bool valid = false;
+            size_t count = 0, edges = 0, size = 0;
+            size_t fanout = 0, oids = 0, times = 0, generations = 0, parentOffsets = 0, parents = 0;
+
+            static size_t align(size_t n) { return (n + 7) & ~size_t(7); }
+
+            static CommitGraphLayout compute(size_t count, size_t edges) {
+                CommitGraphLayout l;
+                l.valid = true;
+                l.count = count;
+                l.edges = edges;
+                l.fanout = headerSize;
+                l.oids = l.fanout + 256 * sizeof(uint32_t);
+                l.times = align(l.oids + count * sizeof(git_oid));
+                l.generations = l.times + count * sizeof(int64_t);
+                l.parentOffsets = align(l.generations + count * sizeof(uint32_t));
+                l.parents = align(l.parentOffsets + (count + 1) * sizeof(uint32_t));
+                l.size = align(l.parents + edges * sizeof(uint32_t));
+                return l;
+            }
+
+            void writeHeader(char * base) const {
+                uint64_t header[3] = {count, edges, size};
+                std::memcpy(base, magic, sizeof(magic));
+                std::memcpy(base + 8, &byteOrder, 4);
+                std::memcpy(base + 12, &version, 4);
+                std::memcpy(base + 16, header, sizeof(header));
+            }
+
+            static CommitGraphLayout read(void const * data, size_t size) {
+                auto base = static_cast<char const *>(data);
+                uint32_t order, ver;
+                uint64_t header[3];
+                if (size < headerSize || std::memcmp(base, magic, sizeof(magic)) != 0) {
+                    return {};
+                }
+                std::memcpy(&order, base + 8, 4);
+                std::memcpy(&ver, base + 12, 4);
+                std::memcpy(header, base + 16, sizeof(header));
+                if (order != byteOrder || ver != version || header[2] != size || header[0] >= UINT32_MAX ||
+                    header[1] >= UINT32_MAX) {
+                    return {};
+                }
+                auto l = compute(size_t(header[0]), size_t(header[1]));
+                if (l.size != size) {
+                    return {};
+                }
+                return l;
+            }
+        };
+
+        // Accumulates commits in walk order for CommitGraph::build().
+        class CommitGraphBuilder {
+        public:
+            template <typename ParentAt>
+            void add(git_oid const & oid, git_time_t time, unsigned int parentCount, ParentAt && parentAt) {
+                oids_.push_back(oid);
+                times_.push_back(time);
+                for (unsigned int i = 0; i < parentCount; ++i) {
+                    parents_.push_back(parentAt(i));
+                }
+                parentOffsets_.push_back(parents_.size());
+            }
+
+            CommitGraph finish();
+
+        private:
+            std::vector<git_oid> oids_;
+            std::vector<int64_t> times_;
+            std::vector<git_oid> parents_;
+            std::vector<size_t> parentOffsets_{0};
+        };
+
+        // Per-commit marks for CommitGraph walks, cleared in O(1) by bumping
+        // a stamp: an entry is live only if its stamp is current. One per
+        // thread, grown to the largest graph walked on it, so queries don't
+        // allocate.
+        struct GraphScratch {
+            std::vector<uint32_t> stamps;
+            std::vector<uint8_t> flags;
+            std::vector<uint32_t> stack;
+            uint32_t stamp = 0;
+
+            // Starts a walk over n commits, clearing all marks.
+            static GraphScratch & begin(size_t n) {
+                static thread_local GraphScratch s;
+                if (s.stamps.size() < n) {
+                    s.stamps.resize(n);
+                    s.flags.resize(n);
+                }
+                if (++s.stamp == 0) {
+                    std::fill(s.stamps.begin(), s.stamps.end(), 0);
+                    s.stamp = 1;
+                }
+                s.stack.clear();
+                return s;
+            }
+
+            uint8_t & flag(size_t i) {
+                if (stamps[i] != stamp) {
+                    stamps[i] = stamp;
+                    flags[i] = 0;
+                }
+                return flags[i];
+            }
+
+            // True the first time i is visited in this walk.
+            bool visit(size_t i) {
+                if (stamps[i] == stamp) {
+                    return false;
+                }
+                stamps[i] = stamp;
+                flags[i] = 0;
+                return true;
+            }
+        };
+
+    }
+
+    // Commit ancestry in flat arrays: commits get dense ids in oid order, with
+    // parent edges in CSR form, generation numbers and commit times. Build it
+    // once from a revwalk, save() it, and open() it later. The file is
+    // memory-mapped and checked in one pass on open, so opening costs no
+    // more than reading it. Queries touch only these arrays and never
+    // allocate libgit2 objects.
+    //
+    // Edges to parents outside the walk (e.g., hidden commits) are dropped, so
+    // push every commit the queries will care about.
+    class CommitGraph {
+    public:
+        using id_t = uint32_t;
+        static constexpr id_t none = UINT32_MAX;
+
+        struct Parents {
+            id_t const * first;
+            id_t const * last;
+            id_t const * begin() const { return first; }
+            id_t const * end() const { return last; }
+            size_t size() const { return size_t(last - first); }
+        };
+
+        CommitGraph() = default;
+
+        static CommitGraph build(UniquePtr<git_revwalk> & walk) {
+            detail::CommitGraphBuilder b;
+            auto repo = walk[git_revwalk_repository]();
+            for (auto && oid : walk) {
+                auto commit = detail::wrap(git_commit_lookup, repo, &oid);
+                unsigned int n = commit[git_commit_parentcount]();
+                b.add(oid, commit[git_commit_time](), n, [&](unsigned int i) { return *commit[git_commit_parent_id](i); });
+            }
+            return b.finish();
+        }
+
+        // Decodes commits on `threads` via parallelRevwalk().
+        static CommitGraph build(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_revwalk> & walk) {
+            detail::CommitGraphBuilder b;
+            parallelRevwalk(repos, threads, walk, [&](CommitBatch && batch) {
+                for (auto & c : batch.commits) {
+                    b.add(c.id, c.time, c.parentCount, [&](unsigned int i) { return c.parents[i]; });
+                }
+            });
+            return b.finish();
+        }
+
+        static CommitGraph open(std::string const & path) {
+            CommitGraph g;
+            g.storage_ = detail::mapFile(path);
+            g.bind(path.c_str());
+            return g;
+        }
+
+        void save(std::string const & path) const {
+            std::unique_ptr<FILE, int (*)(FILE *)> f{std::fopen(path.c_str(), "wb"), &std::fclose};
+            if (!f || std::fwrite(storage_.data, 1, storage_.size, f.get()) != storage_.size || std::fflush(f.get())) {
+                throw Error{"CommitGraph: can't write " + path};
+            }
+        }
+
+        size_t size() const { return count_; }
+
+        // The commit's id, or none.
+        id_t find(git_oid const & oid) const {
+            uint8_t b = oid.id[0];
+            auto first = oids_ + (b ? fanout_[b - 1] : 0);
+            auto last = oids_ + fanout_[b];
+            auto i = std::lower_bound(first, last, oid, [](git_oid const & a, git_oid const & b) {
+                return std::memcmp(a.id, b.id, sizeof(a.id)) < 0;
+            });
+            return i != last && std::memcmp(i->id, oid.id, sizeof(oid.id)) == 0 ? id_t(i - oids_) : none;
+        }
+        id_t find(git_oid const * oid) const { return find(*oid); }
+
+        git_oid const & oid(id_t id) const { return oids_[id]; }
+        git_time_t time(id_t id) const { return times_[id]; }
+        uint32_t generation(id_t id) const { return generations_[id]; }
+        Parents parents(id_t id) const { return {parents_ + parentOffsets_[id], parents_ + parentOffsets_[id + 1]}; }
+
+        // True if `ancestor` is reachable from `descendant` (or equal to it).
+        // Walks parents from descendant, skipping anything whose generation
+        // rules it out.
+        bool isAncestor(id_t ancestor, id_t descendant) const {
+            uint32_t floor = generations_[ancestor];
+            if (generations_[descendant] < floor) {
+                return false;
+            }
+            auto & scratch = detail::GraphScratch::begin(count_);
+            auto & stack = scratch.stack;
+            stack.push_back(descendant);
+            while (!stack.empty()) {
+                id_t x = stack.back();
+                stack.pop_back();
+                if (x == ancestor) {
+                    return true;
+                }
+                for (id_t p : parents(x)) {
+                    if (generations_[p] >= floor && scratch.visit(p)) {
+                        stack.push_back(p);
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Best common ancestors of a and b, as git merge-base --all computes them.
+        std::vector<id_t> mergeBases(id_t a, id_t b) const {
+            if (a == b) {
+                return {a};
+            }
+            enum : uint8_t { P1 = 1, P2 = 2, Stale = 4, Queued = 8 };
+            // Done with before the isAncestor() calls below start new walks.
+            auto & scratch = detail::GraphScratch::begin(count_);
+            auto later = [&](id_t x, id_t y) {
+                return generations_[x] != generations_[y] ? generations_[x] < generations_[y] : x < y;
+            };
+            std::priority_queue<id_t, std::vector<id_t>, decltype(later)> queue{later};
+            // Children always pop before parents (higher generation), so each
+            // commit is queued once and has all its flags by the time it pops.
+            size_t live = 0;    // Queued commits not yet marked stale.
+            auto mark = [&](id_t x, uint8_t f) {
+                auto & flags = scratch.flag(x);
+                uint8_t old = flags;
+                if ((old & f) == f) {
+                    return;
+                }
+                flags |= f;
+                if (!(old & Queued)) {
+                    flags |= Queued;
+                    queue.push(x);
+                    live += !(flags & Stale);
+                } else if (!(old & Stale) && (flags & Stale)) {
+                    --live;
+                }
+            };
+            mark(a, P1);
+            mark(b, P2);
+            std::vector<id_t> candidates;
+            while (live) {
+                id_t x = queue.top();
+                queue.pop();
+                scratch.flag(x) &= ~Queued;
+                uint8_t f = scratch.flag(x) & (P1 | P2 | Stale);
+                if (!(f & Stale)) {
+                    --live;
+                    if ((f & (P1 | P2)) == (P1 | P2)) {
+                        candidates.push_back(x);
+                        f |= Stale;
+                    }
+                }
+                for (id_t p : parents(x)) {
+                    mark(p, f);
+                }
+            }
+            // Drop candidates reachable from another candidate.
+            std::vector<id_t> bases;
+            for (id_t c : candidates) {
+                bool redundant = false;
+                for (id_t d : candidates) {
+                    if (d != c && isAncestor(c, d)) {
+                        redundant = true;
+                        break;
+                    }
+                }
+                if (!redundant) {
+                    bases.push_back(c);
+                }
+            }
+            return bases;
+        }
+
+        // Every commit reachable from heads, children before parents (newest
+        // first among commits that aren't ordered by ancestry).
+        std::vector<id_t> topoOrder(std::vector<id_t> const & heads) const {
+            auto & scratch = detail::GraphScratch::begin(count_);
+            auto & stack = scratch.stack;
+            std::vector<id_t> order;
+            for (id_t h : heads) {
+                if (scratch.visit(h)) {
+                    stack.push_back(h);
+                }
+            }
+            while (!stack.empty()) {
+                id_t x = stack.back();
+                stack.pop_back();
+                order.push_back(x);
+                for (id_t p : parents(x)) {
+                    if (scratch.visit(p)) {
+                        stack.push_back(p);
+                    }
+                }
+            }
+            // A parent's generation is always lower than its child's.
+            std::sort(order.begin(), order.end(), [&](id_t x, id_t y) {
+                if (generations_[x] != generations_[y]) {
+                    return generations_[x] > generations_[y];
+                }
+                return times_[x] != times_[y] ? times_[x] > times_[y] : x < y;
+            });
+            return order;
+        }
+
+    private:
+        friend class detail::CommitGraphBuilder;
+
+        detail::Mapping storage_;
+        size_t count_ = 0;
+        uint32_t const * fanout_ = nullptr;
+        git_oid const * oids_ = nullptr;
+        int64_t const * times_ = nullptr;
+        uint32_t const * generations_ = nullptr;
+        uint32_t const * parentOffsets_ = nullptr;
+        id_t const * parents_ = nullptr;
+
+        void bind(char const * origin) {
+            auto layout = detail::CommitGraphLayout::read(storage_.data, storage_.size);
+            if (!layout.valid) {
+                throw Error{std::string{"CommitGraph: invalid or incompatible graph: "} + origin};
+            }
+            auto base = static_cast<char const *>(storage_.data);
+            count_ = layout.count;
+            fanout_ = reinterpret_cast<uint32_t const *>(base + layout.fanout);
+            oids_ = reinterpret_cast<git_oid const *>(base + layout.oids);
+            times_ = reinterpret_cast<int64_t const *>(base + layout.times);
+            generations_ = reinterpret_cast<uint32_t const *>(base + layout.generations);
+            parentOffsets_ = reinterpret_cast<uint32_t const *>(base + layout.parentOffsets);
+            parents_ = reinterpret_cast<id_t const *>(base + layout.parents);
+
+            // Queries index with these values unchecked, and mergeBases()
+            // relies on parents having lower generations than their children.
+            auto corrupt = [&] { return Error{std::string{"CommitGraph: corrupt graph: "} + origin}; };
+            for (size_t b = 0; b < 256; ++b) {
+                if (fanout_[b] > count_ || (b > 0 && fanout_[b] < fanout_[b - 1])) {
+                    throw corrupt();
+                }
+            }
+            if (fanout_[255] != count_ || parentOffsets_[0] != 0 || parentOffsets_[count_] != layout.edges) {
+                throw corrupt();
+            }
+            for (size_t x = 0; x < count_; ++x) {
+                if (parentOffsets_[x + 1] < parentOffsets_[x]) {
+                    throw corrupt();
+                }
+                for (id_t p : parents(id_t(x))) {
+                    if (p >= count_ || generations_[p] >= generations_[x]) {
+                        throw corrupt();
+                    }
+                }
+            }
+        }
+    };
+
+    namespace detail {
+
+        inline CommitGraph CommitGraphBuilder::finish() {
+            size_t n = oids_.size();
+            if (n >= CommitGraph::none || parents_.size() >= UINT32_MAX) {
+                throw Error{"CommitGraph: too many commits"};
+            }
+
+            std::vector<uint32_t> byOid(n);
+            for (size_t i = 0; i < n; ++i) {
+                byOid[i] = uint32_t(i);
+            }
+            auto less = [](git_oid const & a, git_oid const & b) { return std::memcmp(a.id, b.id, sizeof(a.id)) < 0; };
+            std::sort(byOid.begin(), byOid.end(), [&](uint32_t x, uint32_t y) { return less(oids_[x], oids_[y]); });
+
+            std::vector<git_oid> sorted(n);
+            for (size_t id = 0; id < n; ++id) {
+                sorted[id] = oids_[byOid[id]];
+            }
+            auto idOf = [&](git_oid const & oid) -> uint32_t {
+                auto i = std::lower_bound(sorted.begin(), sorted.end(), oid, less);
+                return i != sorted.end() && !less(oid, *i) ? uint32_t(i - sorted.begin()) : CommitGraph::none;
+            };
+
+            std::vector<uint32_t> offsets(n + 1);
+            std::vector<uint32_t> edges;
+            edges.reserve(parents_.size());
+            for (size_t id = 0; id < n; ++id) {
+                offsets[id] = uint32_t(edges.size());
+                size_t i = byOid[id];
+                for (size_t k = parentOffsets_[i]; k < parentOffsets_[i + 1]; ++k) {
+                    auto p = idOf(parents_[k]);
+                    if (p != CommitGraph::none) {
+                        edges.push_back(p);
+                    }
+                }
+            }
+            offsets[n] = uint32_t(edges.size());
+
+            // Generation = 1 + max parent generation, via iterative post-order DFS.
+            std::vector<uint32_t> generations(n);
+            std::vector<std::pair<uint32_t, uint32_t>> stack;
+            for (uint32_t root = 0; root < n; ++root) {
+                if (generations[root]) {
+                    continue;
+                }
+                stack.push_back({root, offsets[root]});
+                while (!stack.empty()) {
+                    auto & [x, next] = stack.back();
+                    if (next < offsets[x + 1]) {
+                        uint32_t p = edges[next++];
+                        if (!generations[p]) {
+                            stack.push_back({p, offsets[p]});
+                        }
+                        continue;
+                    }
+                    uint32_t g = 0;
+                    for (uint32_t k = offsets[x]; k < offsets[x + 1]; ++k) {
+                        g = std::max(g, generations[edges[k]]);
+                    }
+                    generations[x] = g + 1;
+                    stack.pop_back();
+                }
+            }
+
+            auto layout = CommitGraphLayout::compute(n, edges.size());
+            auto buffer = std::shared_ptr<char>(new char[layout.size](), std::default_delete<char[]>());
+            char * base = buffer.get();
+            layout.writeHeader(base);
+            auto fanout = reinterpret_cast<uint32_t *>(base + layout.fanout);
+            for (size_t id = 0; id < n; ++id) {
+                ++fanout[sorted[id].id[0]];
+            }
+            for (size_t b = 1; b < 256; ++b) {
+                fanout[b] += fanout[b - 1];
+            }
+            std::memcpy(base + layout.oids, sorted.data(), n * sizeof(git_oid));
+            auto times = reinterpret_cast<int64_t *>(base + layout.times);
+            for (size_t id = 0; id < n; ++id) {
+                times[id] = times_[byOid[id]];
+            }
+            std::memcpy(base + layout.generations, generations.data(), n * sizeof(uint32_t));
+            std::memcpy(base + layout.parentOffsets, offsets.data(), (n + 1) * sizeof(uint32_t));
+            std::memcpy(base + layout.parents, edges.data(), edges.size() * sizeof(uint32_t));
+
+            CommitGraph g;
+            g.storage_ = {std::shared_ptr<void const>(buffer, base), base, layout.size};
+            g.bind("(built)");
+            return g;
+        }
+
+    }
+
+    namespace detail {
+
+        inline uint32_t readBE32(unsigned char const * p) {
+            return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+        }
+
+        // Where packed objects live, read from the repository's pack indexes
+        // (.idx version 2), since libgit2 doesn't expose pack offsets.
+        class PackLocator {
+        public:
+            explicit PackLocator(git_repository * repo) {
+                // The common dir, so that worktrees find the main repo's packs.
+                std::error_code ec;
+                auto dir = std::filesystem::path{git_repository_commondir(repo)} / "objects" / "pack";
+                for (auto & entry : std::filesystem::directory_iterator{dir, ec}) {
+                    if (entry.path().extension() != ".idx") {
+                        continue;
+                    }
+                    try {
+                        Index index{mapFile(entry.path().string())};
+                        if (index.valid()) {
+                            indexes_.push_back(std::move(index));
+                        }
+                    } catch (Error const &) {
+                        // Removed by a concurrent repack; its objects just go unordered.
+                    }
+                }
+            }
+
+            size_t packs() const { return indexes_.size(); }
+
+            // Pack number and offset of `id`, or {packs(), 0} if it isn't packed.
+            std::pair<size_t, uint64_t> locate(git_oid const & id) const {
+                for (size_t p = 0; p < indexes_.size(); ++p) {
+                    uint64_t offset;
+                    if (indexes_[p].find(id, offset)) {
+                        return {p, offset};
+                    }
+                }
+                return {indexes_.size(), 0};
+            }
+
+        private:
+            class Index {
+            public:
+                explicit Index(Mapping map) : map_{std::move(map)} {
+                    auto base = static_cast<unsigned char const *>(map_.data);
+                    if (map_.size < 8 + 256 * 4 || readBE32(base) != 0xff744f63 || readBE32(base + 4) != 2) {
+                        return;
+                    }
+                    count_ = readBE32(base + 8 + 255 * 4);
+                    if (map_.size < 8 + 256 * 4 + count_ * (GIT_OID_RAWSZ + 8) + 2 * GIT_OID_RAWSZ) {
+                        return;
+                    }
+                    fanout_ = base + 8;
+                    oids_ = fanout_ + 256 * 4;
+                    offsets_ = oids_ + count_ * (GIT_OID_RAWSZ + 4);
+                    large_ = offsets_ + count_ * 4;
+                }
+
+                bool valid() const { return oids_; }
+
+                bool find(git_oid const & id, uint64_t & offset) const {
+                    size_t lo = id.id[0] ? readBE32(fanout_ + (id.id[0] - 1) * 4) : 0;
+                    size_t hi = std::min<size_t>(readBE32(fanout_ + id.id[0] * 4), count_);
+                    while (lo < hi) {
+                        size_t mid = lo + (hi - lo) / 2;
+                        int cmp = std::memcmp(oids_ + mid * GIT_OID_RAWSZ, id.id, GIT_OID_RAWSZ);
+                        if (cmp == 0) {
+                            uint32_t small = readBE32(offsets_ + mid * 4);
+                            if (small & 0x80000000) {
+                                // Index into the table of 64-bit offsets.
+                                auto p = large_ + size_t(small & 0x7fffffff) * 8;
+                                if (p + 8 > static_cast<unsigned char const *>(map_.data) + map_.size) {
+                                    return false;
+                                }
+                                offset = uint64_t(readBE32(p)) << 32 | readBE32(p + 4);
+                            } else {
+                                offset = small;
+                            }
+                            return true;
+                        }
+                        if (cmp < 0) {
+                            lo = mid + 1;
+                        } else {
+                            hi = mid;
+                        }
+                    }
+                    return false;
+                }
+
+            private:
+                Mapping map_;
+                size_t count_ = 0;
+                unsigned char const * fanout_ = nullptr;
+                unsigned char const * oids_ = nullptr;
+                unsigned char const * offsets_ = nullptr;
+                unsigned char const * large_ = nullptr;
+            };
+
+            std::vector<Index> indexes_;
+        };
+
+        inline git_oid const & oidOf(git_oid const & id) { return id; }
+        inline git_oid const & oidOf(git_oid const * id) { return *id; }
+
+        // The oids of `ids`, and a permutation that visits them pack by pack,
+        // front to back, with unpacked objects last.
+        template <typename Range>
+        std::pair<std::vector<git_oid>, std::vector<size_t>> packOrder(git_repository * repo, Range const & ids) {
+            std::vector<git_oid> oids;
+            for (auto && id : ids) {
+                oids.push_back(oidOf(id));
+            }
+            struct Key {
+                size_t pack;
+                uint64_t offset;
+                size_t i;
+            };
+            PackLocator packs{repo};
+            std::vector<Key> keys(oids.size());
+            for (size_t i = 0; i < oids.size(); ++i) {
+                auto where = packs.locate(oids[i]);
+                keys[i] = {where.first, where.second, i};
+            }
+            std::sort(keys.begin(), keys.end(), [](Key const & a, Key const & b) {
+                return std::tie(a.pack, a.offset, a.i) < std::tie(b.pack, b.offset, b.i);
+            });
+            std::vector<size_t> order(keys.size());
+            for (size_t k = 0; k < keys.size(); ++k) {
+                order[k] = keys[k].i;
+            }
+            return {std::move(oids), std::move(order)};
+        }
+
+    }
+
+    // Looks up every oid in `ids` (a range of git_oid or git_oid const *) and
+    // returns the objects in the same order. Reads are issued in pack order,
+    // taken from the pack indexes, so each pack is read front to back: cold
+    // reads become sequential, and libgit2's delta base cache and pack windows
+    // hit far more often than with lookups in caller order. Throws if any
+    // object is missing or isn't of `type`.
+    template <typename Range>
+    std::vector<UniquePtr<git_object>> lookupObjects(UniquePtr<git_repository> & repo, Range const & ids,
+                                                     git_otype type = GIT_OBJ_ANY) {
+        auto plan = detail::packOrder(&*repo, ids);
+        std::vector<UniquePtr<git_object>> objects(plan.first.size());
+        for (size_t i : plan.second) {
+            objects[i] = repo[git_object_lookup](&plan.first[i], type);
+        }
+        return objects;
+    }
+
+    // Parallel lookupObjects(): the pack-ordered list is cut into contiguous
+    // runs, each looked up on `threads` through a handle leased from `repos`.
+    // The objects belong to those handles, so `repos` must outlive them.
+    template <typename Range>
+    std::vector<UniquePtr<git_object>> lookupObjects(RepositoryPool & repos, ThreadPool & threads, Range const & ids,
+                                                     git_otype type = GIT_OBJ_ANY) {
+        std::pair<std::vector<git_oid>, std::vector<size_t>> plan;
+        {
+            auto repo = repos.lease();
+            plan = detail::packOrder(&**repo, ids);
+        }
+        auto & oids = plan.first;
+        auto & order = plan.second;
+        std::vector<UniquePtr<git_object>> objects(oids.size());
+        // A few runs per thread, so stealing can even out uneven runs.
+        size_t runs = std::min(order.size(), (threads.size() + 1) * 4);
+        threads.parallelFor(runs, [&](size_t r) {
+            auto repo = repos.lease();
+            for (size_t k = r * order.size() / runs, end = (r + 1) * order.size() / runs; k < end; ++k) {
+                auto i = order[k];
+                objects[i] = repo[git_object_lookup](&oids[i], type);
+            }
+        });
+        return objects;
+    }
+
+    // An object seen by parallelOdbScan(). `data` is only set when the scan
+    // reads content, and only valid during the visit.
+    struct OdbScanEntry {
+        git_oid id;
+        git_otype type;
+        size_t size;
+        std::string_view data;
+    };
+
+    struct OdbScanOptions {
+        bool readContent = false;   // Inflate every object, not just its header.
+        size_t runs = 0;            // Contiguous runs handed to workers; 0 = 4 per thread.
+    };
+
+    // Object counts and bytes per type.
+    struct TypeHistogram {
+        uint64_t count[8] = {};     // Indexed by git_otype.
+        uint64_t bytes[8] = {};
+
+        void operator()(OdbScanEntry const & e) {
+            size_t t = size_t(e.type) & 7;
+            ++count[t];
+            bytes[t] += e.size;
+        }
+
+        void merge(TypeHistogram const & that) {
+            for (size_t t = 0; t < 8; ++t) {
+                count[t] += that.count[t];
+                bytes[t] += that.bytes[t];
+            }
+        }
+
+        uint64_t objects() const {
+            uint64_t n = 0;
+            for (auto c : count) {
+                n += c;
+            }
+            return n;
+        }
+    };
+
+    // Object sizes in power-of-two buckets: bucket k counts sizes whose
+    // highest set bit is bit k - 1, and bucket 0 counts empty objects.
+    struct SizeDistribution {
+        uint64_t buckets[65] = {};
+        uint64_t objects = 0;
+        uint64_t bytes = 0;
+        size_t max = 0;
+
+        void operator()(OdbScanEntry const & e) {
+            size_t k = 0;
+            for (size_t s = e.size; s; s >>= 1) {
+                ++k;
+            }
+            ++buckets[k];
+            ++objects;
+            bytes += e.size;
+            max = std::max(max, e.size);
+        }
+
+        void merge(SizeDistribution const & that) {
+            for (size_t k = 0; k < 65; ++k) {
+                buckets[k] += that.buckets[k];
+            }
+            objects += that.objects;
+            bytes += that.bytes;
+            max = std::max(max, that.max);
+        }
+
+        // An upper bound on the q-quantile (0 to 1) of object sizes.
+        size_t quantile(double q) const {
+            auto target = uint64_t(q * double(objects));
+            uint64_t seen = 0;
+            for (size_t k = 0; k < 65; ++k) {
+                seen += buckets[k];
+                if (seen > target || seen == objects) {
+                    return k == 0 ? 0 : std::min(max, k >= 64 ? SIZE_MAX : (size_t(1) << k) - 1);
+                }
+            }
+            return max;
+        }
+    };
+
+    // The `limit` largest objects.
+    class LargestObjects {
+    public:
+        LargestObjects() = default;
+        explicit LargestObjects(size_t limit) : limit_{limit} { }
+
+        void operator()(OdbScanEntry const & e) {
+            if (heap_.size() < limit_) {
+                heap_.push_back({e.id, e.type, e.size, {}});
+                std::push_heap(heap_.begin(), heap_.end(), larger);
+            } else if (limit_ && e.size > heap_.front().size) {
+                std::pop_heap(heap_.begin(), heap_.end(), larger);
+                heap_.back() = {e.id, e.type, e.size, {}};
+                std::push_heap(heap_.begin(), heap_.end(), larger);
+            }
+        }
+
+        void merge(LargestObjects const & that) {
+            for (auto & e : that.heap_) {
+                (*this)(e);
+            }
+        }
+
+        // Largest first.
+        std::vector<OdbScanEntry> objects() const {
+            auto v = heap_;
+            std::sort(v.begin(), v.end(), larger);
+            return v;
+        }
+
+    private:
+        size_t limit_ = 20;
+        std::vector<OdbScanEntry> heap_;    // Min-heap on size.
+
+        static bool larger(OdbScanEntry const & a, OdbScanEntry const & b) { return a.size > b.size; }
+    };
+
+    // The built-in reducers together, for repository health reports.
+    struct OdbStats {
+        TypeHistogram types;
+        SizeDistribution sizes;
+        LargestObjects largest;
+
+        void operator()(OdbScanEntry const & e) {
+            types(e);
+            sizes(e);
+            largest(e);
+        }
+
+        void merge(OdbStats const & that) {
+            types.merge(that.types);
+            sizes.merge(that.sizes);
+            largest.merge(that.largest);
+        }
+    };
+
+    namespace detail {
+
+        template <typename V, typename = void>
+        struct IsReducer : std::false_type {};
+
+        template <typename V>
+        struct IsReducer<V, std::void_t<decltype(std::declval<V &>().merge(std::declval<V const &>()))>> : std::true_type {};
+
+    }
+
+    // Visits every object in the repository's odb on `threads`, each worker
+    // reading through a handle leased from `repos`. The oids are enumerated
+    // with git_odb_foreach, deduplicated and put in pack order (see
+    // lookupObjects), then cut into contiguous runs so each worker reads its
+    // stretch of a pack front to back. Headers are read with
+    // git_odb_read_header unless opts.readContent is set.
+    //
+    // If `visitor` has merge(V const &), it is a reducer: each run visits its
+    // own copy, the copies are merged into `visitor` and the result is
+    // returned, so pass it empty. Otherwise it is called concurrently and
+    // must be thread-safe.
+    template <typename V>
+    V parallelOdbScan(RepositoryPool & repos, ThreadPool & threads, V visitor, OdbScanOptions const & opts = {}) {
+        std::pair<std::vector<git_oid>, std::vector<size_t>> plan;
+        {
+            auto repo = repos.lease();
+            auto odb = repo[git_repository_odb]();
+            std::vector<git_oid> ids;
+            check(detail::call<detail::FailsIfNegative>(git_odb_foreach, &*odb, [](git_oid const * id, void * p) {
+                static_cast<std::vector<git_oid> *>(p)->push_back(*id);
+                return 0;
+            }, static_cast<void *>(&ids)));
+            // Objects in several packs, or both packed and loose, are listed more than once.
+            std::sort(ids.begin(), ids.end(), [](git_oid const & a, git_oid const & b) { return git_oid_cmp(&a, &b) < 0; });
+            ids.erase(std::unique(ids.begin(), ids.end(), [](git_oid const & a, git_oid const & b) { return git_oid_equal(&a, &b); }), ids.end());
+            plan = detail::packOrder(&**repo, ids);
+        }
+        auto & oids = plan.first;
+        auto & order = plan.second;
+
+        size_t runs = std::min(order.size(), opts.runs ? opts.runs : (threads.size() + 1) * 4);
+        std::vector<std::optional<V>> partial(detail::IsReducer<V>::value ? runs : 0);
+        threads.parallelFor(runs, [&](size_t r) {
+            auto repo = repos.lease();
+            auto odb = repo[git_repository_odb]();
+            auto visit = [&](OdbScanEntry const & e) {
+                if constexpr (detail::IsReducer<V>::value) {
+                    (*partial[r])(e);
+                } else {
+                    visitor(e);
+                }
+            };
+            if constexpr (detail::IsReducer<V>::value) {
+                partial[r].emplace(visitor);
+            }
+            for (size_t k = r * order.size() / runs, end = (r + 1) * order.size() / runs; k < end; ++k) {
+                auto & id = oids[order[k]];
+                if (opts.readContent) {
+                    auto object = odb[git_odb_read](&id);
+                    visit({id, object[git_odb_object_type](), object[git_odb_object_size](), object.view()});
+                } else {
+                    OdbScanEntry e{id, GIT_OBJ_ANY, 0, {}};
+                    check(detail::call<detail::FailsIfNegative>(git_odb_read_header, &e.size, &e.type, &*odb, &id));
+                    visit(e);
+                }
+            }
+        });
+        if constexpr (detail::IsReducer<V>::value) {
+            for (auto & p : partial) {
+                visitor.merge(*p);
+            }
+        }
+        return visitor;
+    }
+
+    // Per-file line counts over a range of history, as git log --numstat
+    // reports them, in columns: row r says commits[commit[r]] changed
+    // paths[path[r]] by additions[r] and deletions[r]. Commits are numbered in
+    // walk order, paths in order of first appearance. Rows come in commit order.
+    struct HistoryStats {
+        std::vector<git_oid> commits;
+        std::vector<std::string> paths;
+        std::vector<uint32_t> commit;
+        std::vector<uint32_t> path;
+        std::vector<uint32_t> additions;
+        std::vector<uint32_t> deletions;
+
+        size_t rows() const { return commit.size(); }
+    };
+
+    struct HistoryStatsOptions {
+        git_diff_options const * diff = nullptr;    // Shared by all workers.
+        std::string cache;          // File of results from earlier runs; empty = none.
+        size_t batchSize = 64;      // Commits per task.
+    };
+
+    namespace detail {
+
+        struct NumstatFile {
+            std::string path;
+            uint32_t additions;
+            uint32_t deletions;
+        };
+
+        struct Numstat {
+            git_oid parent;         // Zero for root commits.
+            std::vector<NumstatFile> files;
+        };
+
+        // Diffs a commit against its first parent, or the empty tree for a root.
+        inline Numstat numstat(UniquePtr<git_repository> & repo, git_oid const & id, git_diff_options const * opts) {
+            Numstat result{};
+            auto commit = repo[git_commit_lookup](&id);
+            auto tree = commit[git_commit_tree]();
+            UniquePtr<git_tree> parentTree;
+            if (commit[git_commit_parentcount]()) {
+                auto parent = commit[git_commit_parent](0);
+                result.parent = *parent[git_commit_id]();
+                parentTree = parent[git_commit_tree]();
+            }
+            auto diff = repo[git_diff_tree_to_tree](parentTree ? &*parentTree : nullptr, &*tree, opts);
+            size_t n = diff[git_diff_num_deltas]();
+            result.files.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                auto delta = diff[git_diff_get_delta](i);
+                size_t context = 0, additions = 0, deletions = 0;
+                // No patch for binary files; they count as 0/0.
+                auto patch = wrap(git_patch_from_diff, &*diff, i);
+                if (patch) {
+                    check(call<FailsIfNegative>(git_patch_line_stats, &context, &additions, &deletions, &*patch));
+                }
+                result.files.push_back({delta->new_file.path, uint32_t(additions), uint32_t(deletions)});
+            }
+            return result;
+        }
+
+        // Append-only file of Numstat records keyed by commit, in native byte
+        // order: a 16-byte header, then per commit its oid, its parent's oid, a
+        // file count and, per file, additions, deletions, path length and path.
+        // A commit's oid fixes its first parent, so the commit alone is the key.
+        // Results depend on the diff options, so use one file per option set.
+        class NumstatCache {
+        public:
+            explicit NumstatCache(std::string path) : path_{std::move(path)} {
+                Mapping map;
+                try {
+                    map = mapFile(path_);
+                } catch (Error const &) {
+                    return;
+                }
+                auto p = static_cast<char const *>(map.data);
+                auto end = p + map.size;
+                uint32_t order, ver;
+                if (map.size < headerSize || std::memcmp(p, magic, sizeof(magic)) != 0) {
+                    return;
+                }
+                std::memcpy(&order, p + 8, 4);
+                std::memcpy(&ver, p + 12, 4);
+                if (order != byteOrder || ver != version) {
+                    return;
+                }
+                auto read32 = [&](uint32_t & v) {
+                    if (end - p < 4) {
+                        return false;
+                    }
+                    std::memcpy(&v, p, 4);
+                    p += 4;
+                    return true;
+                };
+                p += headerSize;
+                valid_ = headerSize;
+                while (end - p >= 2 * GIT_OID_RAWSZ + 4) {
+                    git_oid id;
+                    Numstat entry;
+                    std::memcpy(id.id, p, GIT_OID_RAWSZ);
+                    std::memcpy(entry.parent.id, p + GIT_OID_RAWSZ, GIT_OID_RAWSZ);
+                    p += 2 * GIT_OID_RAWSZ;
+                    uint32_t files = 0, len = 0;
+                    read32(files);
+                    bool complete = true;
+                    for (uint32_t f = 0; f < files && complete; ++f) {
+                        NumstatFile file;
+                        complete = read32(file.additions) && read32(file.deletions) && read32(len) && size_t(end - p) >= len;
+                        if (complete) {
+                            file.path.assign(p, len);
+                            p += len;
+                            entry.files.push_back(std::move(file));
+                        }
+                    }
+                    if (!complete) {
+                        break;
+                    }
+                    entries_.insert(id, std::move(entry));
+                    valid_ = size_t(p - static_cast<char const *>(map.data));
+                }
+            }
+
+            Numstat const * find(git_oid const & id) const { return entries_.find(id); }
+
+            void add(git_oid const & id, Numstat const & entry) {
+                auto put32 = [&](uint32_t v) {
+                    auto b = reinterpret_cast<char const *>(&v);
+                    pending_.insert(pending_.end(), b, b + 4);
+                };
+                pending_.insert(pending_.end(), id.id, id.id + GIT_OID_RAWSZ);
+                pending_.insert(pending_.end(), entry.parent.id, entry.parent.id + GIT_OID_RAWSZ);
+                put32(uint32_t(entry.files.size()));
+                for (auto & file : entry.files) {
+                    put32(file.additions);
+                    put32(file.deletions);
+                    put32(uint32_t(file.path.size()));
+                    pending_.insert(pending_.end(), file.path.begin(), file.path.end());
+                }
+            }
+
+            // Appends what add() collected. A record cut short by a crash is
+            // dropped first; a missing or unreadable file is started afresh.
+            void flush() {
+                if (pending_.empty()) {
+                    return;
+                }
+                std::error_code ec;
+                if (valid_ && std::filesystem::file_size(path_, ec) != valid_) {
+                    std::filesystem::resize_file(path_, valid_, ec);
+                }
+                std::unique_ptr<FILE, int (*)(FILE *)> f{std::fopen(path_.c_str(), valid_ ? "ab" : "wb"), &std::fclose};
+                bool ok = bool(f);
+                if (ok && !valid_) {
+                    char header[headerSize];
+                    std::memcpy(header, magic, sizeof(magic));
+                    std::memcpy(header + 8, &byteOrder, 4);
+                    std::memcpy(header + 12, &version, 4);
+                    ok = std::fwrite(header, 1, headerSize, f.get()) == headerSize;
+                }
+                if (!ok || std::fwrite(pending_.data(), 1, pending_.size(), f.get()) != pending_.size() || std::fflush(f.get())) {
+                    throw Error{"historyStats: can't write " + path_};
+                }
+                valid_ = std::filesystem::file_size(path_, ec);
+                pending_.clear();
+            }
+
+        private:
+            static constexpr char magic[8] = {'G', '2', 'P', 'P', 'N', 'U', 'M', 'S'};
+            static constexpr uint32_t byteOrder = 0x01020304;
+            static constexpr uint32_t version = 1;
+            static constexpr size_t headerSize = 16;
+
+            std::string path_;
+            OidMap<Numstat> entries_;
+            size_t valid_ = 0;      // Bytes of intact records, or 0 to start afresh.
+            std::vector<char> pending_;
+        };
+
+    }
+
+    // git log --numstat for every commit in `walk`: each commit is diffed
+    // against its first parent (root commits against the empty tree) on
+    // `threads`, through handles leased from `repos`, in batches of
+    // opts.batchSize. Merges are diffed like any other commit. With
+    // opts.cache, results are read from and appended to that file, so a
+    // re-run only diffs commits it hasn't seen.
+    inline HistoryStats historyStats(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_revwalk> & walk,
+                                     HistoryStatsOptions const & opts = {}) {
+        HistoryStats stats;
+        for (auto && oid : walk) {
+            stats.commits.push_back(oid);
+        }
+        size_t n = stats.commits.size();
+
+        std::optional<detail::NumstatCache> cache;
+        if (!opts.cache.empty()) {
+            cache.emplace(opts.cache);
+        }
+        std::vector<detail::Numstat> computed(n);
+        std::vector<detail::Numstat const *> results(n);
+        std::vector<size_t> missing;
+        for (size_t i = 0; i < n; ++i) {
+            if (cache && (results[i] = cache->find(stats.commits[i]))) {
+                continue;
+            }
+            results[i] = &computed[i];
+            missing.push_back(i);
+        }
+
+        size_t batchSize = opts.batchSize ? opts.batchSize : 1;
+        threads.parallelFor((missing.size() + batchSize - 1) / batchSize, [&](size_t b) {
+            auto repo = repos.lease();
+            for (size_t k = b * batchSize, end = std::min(missing.size(), k + batchSize); k < end; ++k) {
+                size_t i = missing[k];
+                computed[i] = detail::numstat(*repo, stats.commits[i], opts.diff);
+            }
+        });
+
+        std::unordered_map<std::string, uint32_t> pathIds;
+        for (size_t i = 0; i < n; ++i) {
+            for (auto & file : results[i]->files) {
+                auto id = pathIds.emplace(file.path, uint32_t(stats.paths.size()));
+                if (id.second) {
+                    stats.paths.push_back(file.path);
+                }
+                stats.commit.push_back(uint32_t(i));
+                stats.path.push_back(id.first->second);
+                stats.additions.push_back(file.additions);
+                stats.deletions.push_back(file.deletions);
+            }
+        }
+
+        if (cache) {
+            for (size_t i : missing) {
+                cache->add(stats.commits[i], computed[i]);
+            }
+            cache->flush();
+        }
+        return stats;
+    }
+
+    // Blames each of `paths` (strings or char const *) as of `commit`, one
+    // task per file on `threads`, each through a handle leased from `repos`,
+    // and calls consume(std::string const & path, UniquePtr<git_blame> &&) on
+    // the calling thread as blames finish, in completion order. `opts`
+    // supplies everything but newest_commit. The blames belong to the pool's
+    // handles, so `repos` must outlive them. The first failure is rethrown
+    // once the remaining tasks have finished.
+    //
+    // libgit2 caches parsed commits per handle, and handles can't be shared
+    // between threads, so each worker decodes the history it walks once and
+    // reuses it for every later file; pool affinity keeps a thread on the
+    // same handle. Pack windows and the delta base cache are shared through
+    // the pool's common odb (libgit2 >= 1.2).
+    template <typename Paths, typename F>
+    void blameMany(RepositoryPool & repos, ThreadPool & threads, git_oid const & commit, Paths const & paths,
+                   F && consume, git_blame_options const * opts = nullptr) {
+        git_blame_options options = GIT_BLAME_OPTIONS_INIT;
+        if (opts) {
+            options = *opts;
+        }
+        options.newest_commit = commit;
+
+        struct Done {
+            std::string const * path;
+            UniquePtr<git_blame> blame;
+            std::exception_ptr error;
+        };
+        std::vector<std::string> names;
+        for (auto && path : paths) {
+            names.emplace_back(path);
+        }
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Done> done;
+        size_t finished = 0;
+
+        // Outstanding tasks reference the locals above, so wait them out even
+        // if consume() throws.
+        struct Drain {
+            std::mutex & mutex;
+            std::condition_variable & ready;
+            size_t & finished;
+            size_t total;
+            ~Drain() {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [&] { return finished == total; });
+            }
+        } drain{mutex, ready, finished, names.size()};
+
+        for (auto & name : names) {
+            threads.submit([&repos, &options, &mutex, &ready, &done, &finished, path = &name] {
+                Done d{path, nullptr, nullptr};
+                try {
+                    auto repo = repos.lease();
+                    d.blame = repo[git_blame_file](path->c_str(), &options);
+                } catch (...) {
+                    d.error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock{mutex};
+                done.push_back(std::move(d));
+                ++finished;
+                ready.notify_all();
+            });
+        }
+        for (size_t consumed = 0; consumed < names.size(); ++consumed) {
+            Done d{};
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [&] { return !done.empty(); });
+                d = std::move(done.front());
+                done.pop_front();
+            }
+            if (d.error) {
+                std::rethrow_exception(d.error);
+            }
+            consume(*d.path, std::move(d.blame));
+        }
+    }
+
+    // Writes a whole tree from a list of files: add() each path (relative,
+    // '/'-separated) with its mode and either an existing oid or the blob's
+    // content, then write() for the root tree's oid. Blobs are written first,
+    // across `threads` in the parallel variant. Entries are then sorted by
+    // path, which keeps each directory's entries contiguous, and assembled
+    // bottom-up in one pass, with one git_treebuilder per open directory.
+    // Directories are implied by the paths; empty ones can't be expressed.
+    class TreeBuilder {
+    public:
+        explicit TreeBuilder(UniquePtr<git_repository> & repo) : repo_{repo} { }
+
+        void add(std::string path, git_filemode_t mode, git_oid const & id) {
+            entries_.push_back({std::move(path), mode, id, false, {}});
+        }
+
+        void add(std::string path, git_filemode_t mode, std::string content) {
+            entries_.push_back({std::move(path), mode, {}, true, std::move(content)});
+        }
+
+        void reserve(size_t n) { entries_.reserve(n); }
+        size_t size() const { return entries_.size(); }
+
+        git_oid write() {
+            for (auto & e : entries_) {
+                writeBlob(repo_, e);
+            }
+            return assemble();
+        }
+
+        // Writes blobs in contiguous runs on `threads`, each through a handle
+        // leased from `repos`, which must be open on the same repository.
+        git_oid write(RepositoryPool & repos, ThreadPool & threads) {
+            std::vector<Entry *> blobs;
+            for (auto & e : entries_) {
+                if (e.hasContent) {
+                    blobs.push_back(&e);
+                }
+            }
+            size_t runs = std::min(blobs.size(), (threads.size() + 1) * 4);
+            threads.parallelFor(runs, [&](size_t r) {
+                auto repo = repos.lease();
+                for (size_t k = r * blobs.size() / runs, end = (r + 1) * blobs.size() / runs; k < end; ++k) {
+                    writeBlob(*repo, *blobs[k]);
+                }
+            });
+            return assemble();
+        }
+
+    private:
+        struct Entry {
+            std::string path;
+            git_filemode_t mode;
+            git_oid id;
+            bool hasContent;
+            std::string content;
+        };
+
+        struct Dir {
+            std::string_view path;  // No trailing slash; empty for the root.
+            UniquePtr<git_treebuilder> builder;
+        };
+
+        UniquePtr<git_repository> & repo_;
+        std::vector<Entry> entries_;
+
+        // Content is released as soon as it's written.
+        static void writeBlob(UniquePtr<git_repository> & repo, Entry & e) {
+            if (e.hasContent) {
+                e.id = repo[git_blob_create_frombuffer](e.content.data(), e.content.size());
+                e.hasContent = false;
+                std::string{}.swap(e.content);
+            }
+        }
+
+        static void insert(Dir & dir, std::string_view path, git_oid const & id, git_filemode_t mode) {
+            std::string name{path.substr(dir.path.empty() ? 0 : dir.path.size() + 1)};
+            if (git_treebuilder_get(&*dir.builder, name.c_str())) {
+                throw Error{"TreeBuilder: duplicate path " + std::string{path}};
+            }
+            check(detail::call<detail::FailsIfNegative>(git_treebuilder_insert, nullptr, &*dir.builder, name.c_str(), &id, mode));
+        }
+
+        git_oid assemble() {
+            std::sort(entries_.begin(), entries_.end(), [](Entry const & a, Entry const & b) { return a.path < b.path; });
+            std::vector<Dir> open;
+            open.push_back({{}, repo_[git_treebuilder_new](nullptr)});
+            auto close = [&] {
+                auto dir = std::move(open.back());
+                open.pop_back();
+                insert(open.back(), dir.path, dir.builder[git_treebuilder_write](), GIT_FILEMODE_TREE);
+            };
+            for (auto & e : entries_) {
+                std::string_view path{e.path};
+                auto slash = path.rfind('/');
+                auto parent = slash == path.npos ? std::string_view{} : path.substr(0, slash);
+                // Close directories that don't contain this entry...
+                while (!open.back().path.empty() &&
+                       !(parent.size() >= open.back().path.size() && parent.substr(0, open.back().path.size()) == open.back().path &&
+                         (parent.size() == open.back().path.size() || parent[open.back().path.size()] == '/'))) {
+                    close();
+                }
+                // ...then open the ones between the innermost open one and it.
+                while (open.back().path.size() < parent.size()) {
+                    size_t start = open.back().path.empty() ? 0 : open.back().path.size() + 1;
+                    open.push_back({parent.substr(0, std::min(parent.find('/', start), parent.size())),
+                                    repo_[git_treebuilder_new](nullptr)});
+                }
+                insert(open.back(), path, e.id, e.mode);
+            }
+            while (open.size() > 1) {
+                close();
+            }
+            return open.back().builder[git_treebuilder_write]();
+        }
+    };
+
+    struct StageStats {
+        size_t staged = 0;          // Added or updated.
+        size_t unchanged = 0;       // Stat data matched the index; not hashed.
+        size_t removed = 0;         // Tracked but gone from the working tree.
+    };
+
+    namespace detail {
+
+        struct StagedFile {
+            enum { unchanged, staged, removed } state = unchanged;
+            git_index_entry entry{};
+        };
+
+#if !defined(_WIN32)
+        inline git_index_time indexTime(time_t seconds, long nanoseconds) {
+            return {int32_t(seconds), uint32_t(nanoseconds)};
+        }
+
+        inline bool sameTime(git_index_time a, git_index_time b) {
+            return a.seconds == b.seconds && a.nanoseconds == b.nanoseconds;
+        }
+
+        // Copies the stat data git keeps in the index from `st` into `e`.
+        inline void statEntry(git_index_entry & e, struct stat const & st) {
+#if defined(__APPLE__)
+            e.mtime = indexTime(st.st_mtimespec.tv_sec, st.st_mtimespec.tv_nsec);
+            e.ctime = indexTime(st.st_ctimespec.tv_sec, st.st_ctimespec.tv_nsec);
+#else
+            e.mtime = indexTime(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+            e.ctime = indexTime(st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+#endif
+            e.dev = uint32_t(st.st_dev);
+            e.ino = uint32_t(st.st_ino);
+            e.uid = uint32_t(st.st_uid);
+            e.gid = uint32_t(st.st_gid);
+            e.file_size = uint32_t(st.st_size);
+        }
+
+        // Fills `f` for the working tree file at `path`: unchanged if its stat
+        // data matches `tracked` (its current index entry, if any), otherwise
+        // staged with the blob written through `repo`.
+        inline void prepareStage(UniquePtr<git_repository> & repo, std::string const & workdir, std::string const & path,
+                                 git_index_entry const * tracked, int32_t racy, bool trustMode, StagedFile & f) {
+            struct stat st;
+            bool exists = ::lstat((workdir + path).c_str(), &st) == 0;
+            // A submodule's working tree is a directory; its gitlink entry
+            // follows the submodule's HEAD, which staging doesn't move.
+            if (exists && S_ISDIR(st.st_mode) && tracked && tracked->mode == GIT_FILEMODE_COMMIT) {
+                f.state = StagedFile::unchanged;
+                return;
+            }
+            if (!exists || S_ISDIR(st.st_mode)) {
+                if (!tracked) {
+                    throw Error{"stage: no such file " + path};
+                }
+                f.state = StagedFile::removed;
+                return;
+            }
+            uint32_t mode;
+            if (S_ISLNK(st.st_mode)) {
+                mode = GIT_FILEMODE_LINK;
+            } else if (!S_ISREG(st.st_mode)) {
+                throw Error{"stage: not a regular file " + path};
+            } else if (trustMode) {
+                mode = st.st_mode & S_IXUSR ? GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+            } else {
+                bool keep = tracked && tracked->mode != GIT_FILEMODE_LINK && tracked->mode != GIT_FILEMODE_COMMIT;
+                mode = keep ? uint32_t(tracked->mode) : uint32_t(GIT_FILEMODE_BLOB);
+            }
+            auto & e = f.entry;
+            statEntry(e, st);
+            e.mode = mode;
+            e.path = path.c_str();
+            // A file modified in the same second the index was written may
+            // have changed without its stat data showing it, so rehash it.
+            if (tracked && tracked->mode == mode && sameTime(tracked->mtime, e.mtime) && sameTime(tracked->ctime, e.ctime) &&
+                tracked->ino == e.ino && tracked->file_size == e.file_size && e.mtime.seconds < racy) {
+                f.state = StagedFile::unchanged;
+                return;
+            }
+            // Applies the path's filters (e.g. CRLF conversion), as git_index_add_bypath does.
+            e.id = repo[git_blob_create_fromworkdir](path.c_str());
+            f.state = StagedFile::staged;
+        }
+#endif
+
+        // Moves path's conflict, if it has one, to the resolve-undo section, as
+        // git_index_add_bypath does; git_index_add leaves stages 1-3 in place.
+        inline void resolveConflict(UniquePtr<git_index> & index, char const * path) {
+            git_index_entry const * ancestor;
+            git_index_entry const * ours;
+            git_index_entry const * theirs;
+            int rc = call<FailsIfNegative>(git_index_conflict_get, &ancestor, &ours, &theirs, &*index, path);
+            if (rc == GIT_ENOTFOUND) {
+                giterr_clear();
+                return;
+            }
+            check(rc);
+            auto mode = [](git_index_entry const * e) { return e ? int(e->mode) : 0; };
+            auto id = [](git_index_entry const * e) { return e ? &e->id : nullptr; };
+            check(call<FailsIfNegative>(git_index_reuc_add, &*index, path, mode(ancestor), id(ancestor),
+                                        mode(ours), id(ours), mode(theirs), id(theirs)));
+            check(call<FailsIfNegative>(git_index_conflict_remove, &*index, path));
+        }
+
+        inline StageStats stage(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_index> & index,
+                                std::vector<std::string> paths) {
+            StageStats stats;
+            git_repository * repo = index[git_index_owner]();
+            char const * workdir = repo ? git_repository_workdir(repo) : nullptr;
+            if (!workdir) {
+                throw Error{"stage: index has no working tree"};
+            }
+#if !defined(_WIN32)
+            int trustMode = 1;
+            {
+                auto config = wrap(git_repository_config_snapshot, repo);
+                if (call<FailsIfNegative>(git_config_get_bool, &trustMode, &*config, "core.filemode") < 0) {
+                    trustMode = 1;
+                }
+            }
+            // Entries with mtimes at or after the index file's are racily clean.
+            int32_t racy = INT32_MAX;
+            struct stat st;
+            if (auto indexPath = index[git_index_path]()) {
+                if (::stat(indexPath, &st) == 0) {
+                    racy = int32_t(st.st_mtime);
+                }
+            }
+            // The index isn't touched until every file is prepared, so workers
+            // can read its entries through this map.
+            std::unordered_map<std::string_view, git_index_entry const *> tracked;
+            size_t count = index[git_index_entrycount]();
+            tracked.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                auto e = index[git_index_get_byindex](i);
+                if ((e->flags & 0x3000) == 0) {  // Stage 0 only.
+                    tracked.emplace(e->path, e);
+                }
+            }
+
+            std::string root{workdir};
+            std::vector<StagedFile> files(paths.size());
+            size_t runs = std::min(paths.size(), (threads.size() + 1) * 4);
+            threads.parallelFor(runs, [&](size_t r) {
+                auto lease = repos.lease();
+                for (size_t k = r * paths.size() / runs, end = (r + 1) * paths.size() / runs; k < end; ++k) {
+                    auto t = tracked.find(paths[k]);
+                    prepareStage(*lease, root, paths[k], t == tracked.end() ? nullptr : t->second, racy, trustMode, files[k]);
+                }
+            });
+
+            // Apply in path order, so each insertion lands at the end of the
+            // run of entries it extends.
+            std::vector<size_t> order(paths.size());
+            for (size_t k = 0; k < order.size(); ++k) {
+                order[k] = k;
+            }
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return paths[a] < paths[b]; });
+            bool conflicts = index[git_index_has_conflicts]() != 0;
+            for (size_t k : order) {
+                switch (files[k].state) {
+                case StagedFile::unchanged:
+                    ++stats.unchanged;
+                    break;
+                case StagedFile::staged:
+                    check(call<FailsIfNegative>(git_index_add, &*index, &files[k].entry));
+                    if (conflicts) {
+                        resolveConflict(index, paths[k].c_str());
+                    }
+                    ++stats.staged;
+                    break;
+                case StagedFile::removed:
+                    check(call<FailsIfNegative>(git_index_remove_bypath, &*index, paths[k].c_str()));
+                    ++stats.removed;
+                    break;
+                }
+            }
+#else
+            // No lstat; fall back to libgit2, one file at a time.
+            (void)repos;
+            (void)threads;
+            for (auto & path : paths) {
+                check(call<FailsIfNegative>(git_index_add_bypath, &*index, path.c_str()));
+                ++stats.staged;
+            }
+#endif
+            return stats;
+        }
+
+    }
+
+    // Stages `paths` (strings or char const *, relative to the working tree)
+    // into `index`, like git_index_add_bypath for each, but with the work
+    // spread over `threads`. Each file is lstat'ed and, unless its stat data
+    // matches its index entry, hashed and written as a blob through a handle
+    // leased from `repos` (open on the same repository). The prepared entries
+    // are then added in one pass in path order. Tracked paths that no longer
+    // exist are removed. Call git_index_write() to save the result.
+    template <typename Paths>
+    StageStats stagePaths(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_index> & index, Paths const & paths) {
+        std::vector<std::string> v;
+        for (auto && path : paths) {
+            v.emplace_back(path);
+        }
+        return detail::stage(repos, threads, index, std::move(v));
+    }
+
+    // git add --all: stages every tracked file and every untracked file that
+    // isn't ignored, via stagePaths(). Nested repositories and submodules are
+    // left alone.
+    inline StageStats stageAll(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_index> & index) {
+        git_repository * repo = index[git_index_owner]();
+        char const * workdir = repo ? git_repository_workdir(repo) : nullptr;
+        if (!workdir) {
+            throw Error{"stage: index has no working tree"};
+        }
+        std::vector<std::string> paths;
+        std::unordered_set<std::string> seen;
+        size_t count = index[git_index_entrycount]();
+        for (size_t i = 0; i < count; ++i) {
+            auto e = index[git_index_get_byindex](i);
+            if (e->mode != GIT_FILEMODE_COMMIT && seen.insert(e->path).second) {
+                paths.push_back(e->path);
+            }
+        }
+
+        namespace fs = std::filesystem;
+        fs::path root{workdir};
+        auto isIgnored = [&](std::string const & path) {
+            int ignored = 0;
+            check(detail::call<detail::FailsIfNegative>(git_ignore_path_is_ignored, &ignored, repo, path.c_str()));
+            return ignored != 0;
+        };
+        for (auto i = fs::recursive_directory_iterator{root}; i != fs::recursive_directory_iterator{}; ++i) {
+            auto rel = i->path().lexically_relative(root).generic_string();
+            auto type = i->symlink_status().type();
+            if (i->path().filename() == ".git") {
+                i.disable_recursion_pending();
+            } else if (type == fs::file_type::directory) {
+                if (fs::exists(i->path() / ".git") || isIgnored(rel + "/")) {
+                    i.disable_recursion_pending();
+                }
+            } else if ((type == fs::file_type::regular || type == fs::file_type::symlink) && !seen.count(rel) && !isIgnored(rel)) {
+                paths.push_back(rel);
+            }
+        }
+        return detail::stage(repos, threads, index, std::move(paths));
+    }
+
+
+    // The merged result of parallelStatus(), ordered as git_status_list_new
+    // would order it.
+    class StatusList {
+    public:
+        using const_iterator = std::vector<git_status_entry const *>::const_iterator;
+
+        size_t size() const { return entries_.size(); }
+        bool empty() const { return entries_.empty(); }
+        git_status_entry const * operator[](size_t i) const { return entries_[i]; }
+        const_iterator begin() const { return entries_.begin(); }
+        const_iterator end() const { return entries_.end(); }
+
+        // The path an entry sorts by.
+        static char const * path(git_status_entry const * e) {
+            auto delta = e->index_to_workdir ? e->index_to_workdir : e->head_to_index;
+            return delta ? delta->new_file.path : "";
+        }
+
+    private:
+        friend StatusList parallelStatus(RepositoryPool &, ThreadPool &, git_status_options const *);
+
+        std::vector<UniquePtr<git_status_list>> lists_;
+        std::vector<git_status_entry const *> entries_;
+
+        void append(UniquePtr<git_status_list> list) {
+            for (size_t i = 0, n = list[git_status_list_entrycount](); i < n; ++i) {
+                entries_.push_back(list[git_status_byindex](i));
+            }
+            lists_.push_back(std::move(list));
+        }
+    };
+
+    namespace detail {
+
+        // Splits the working tree into disjoint groups of literal pathspecs
+        // with at most about `target` tracked entries each, descending into
+        // directories that are bigger than that. Names come from the index,
+        // the baseline tree (for staged deletions) and the working directory
+        // (for untracked files), so that every path status could report is
+        // covered.
+        class StatusPartitioner {
+        public:
+            struct Part {
+                std::vector<std::string> paths;
+                size_t weight;
+            };
+
+            StatusPartitioner(std::string workdir, git_tree * baseline, size_t target)
+            : workdir_{std::move(workdir)}, baseline_{baseline}, target_{target} { }
+
+            // Returns a part holding tracked entries under `prefix`, or npos.
+            size_t split(std::string const & prefix, std::vector<std::string_view> const & tracked) {
+                std::map<std::string, std::vector<std::string_view>> children;
+                for (auto path : tracked) {
+                    auto rest = path.substr(prefix.size());
+                    children[std::string{rest.substr(0, rest.find('/'))}].push_back(path);
+                }
+                if (auto tree = subtree(prefix)) {
+                    for (size_t i = 0, n = git_tree_entrycount(&*tree); i < n; ++i) {
+                        children[git_tree_entry_name(git_tree_entry_byindex(&*tree, i))];
+                    }
+                }
+                std::error_code ec;
+                for (auto & entry : std::filesystem::directory_iterator{workdir_ + prefix, ec}) {
+                    auto name = entry.path().filename().string();
+                    if (name != ".git") {
+                        children[name];
+                    }
+                }
+                size_t anchor = std::string_view::npos;
+                std::vector<std::string> untracked;
+                for (auto & [name, paths] : children) {
+                    auto path = prefix + name;
+                    bool dir = !paths.empty() && paths.front().size() > path.size();
+                    size_t part;
+                    if (dir && paths.size() > target_) {
+                        part = split(path + "/", paths);
+                    } else if (paths.empty() && !prefix.empty()) {
+                        untracked.push_back(std::move(path));
+                        continue;
+                    } else {
+                        part = parts.size();
+                        parts.push_back({{std::move(path)}, std::max<size_t>(paths.size(), 1)});
+                    }
+                    if (anchor == std::string_view::npos && !paths.empty()) {
+                        anchor = part;
+                    }
+                }
+                // libgit2 only looks for untracked files in a directory if
+                // the scan's pathspec also covers tracked entries under it,
+                // so these ride along with a part that does.
+                for (auto & path : untracked) {
+                    parts[anchor].paths.push_back(std::move(path));
+                    ++parts[anchor].weight;
+                }
+                return anchor;
+            }
+
+            std::vector<Part> parts;
+
+        private:
+            std::string workdir_;
+            git_tree * baseline_;
+            size_t target_;
+
+            UniquePtr<git_tree> subtree(std::string const & prefix) {
+                if (!baseline_) {
+                    return {};
+                }
+                if (prefix.empty()) {
+                    return wrap(git_tree_dup, baseline_);
+                }
+                git_tree_entry * e;
+                if (git_tree_entry_bypath(&e, baseline_, prefix.substr(0, prefix.size() - 1).c_str()) < 0) {
+                    giterr_clear();
+                    return {};
+                }
+                UniquePtr<git_tree_entry> entry{e};
+                if (git_tree_entry_type(e) != GIT_OBJ_TREE) {
+                    return {};
+                }
+                return wrap(git_tree_lookup, git_tree_owner(baseline_), git_tree_entry_id(e));
+            }
+        };
+
+    }
+
+    // git_status_list_new with the scan spread over `threads`. The working
+    // tree is split into disjoint pathspecs by directory, balanced by entry
+    // count, and each group is scanned through a handle leased from `repos`.
+    // The index is read once from disk and shared by every scan; the handles
+    // get their own indexes back afterwards. Options that can't be
+    // split this way (a pathspec of the caller's, rename detection or
+    // GIT_STATUS_OPT_UPDATE_INDEX) fall back to one serial scan.
+    inline StatusList parallelStatus(RepositoryPool & repos, ThreadPool & threads, git_status_options const * opts = nullptr) {
+        git_status_options options = GIT_STATUS_OPTIONS_INIT;
+        if (opts) {
+            options = *opts;
+        }
+        StatusList result;
+        auto lease = repos.lease();
+        unsigned int serialOnly = GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX | GIT_STATUS_OPT_RENAMES_INDEX_TO_WORKDIR |
+                                  GIT_STATUS_OPT_RENAMES_FROM_REWRITES | GIT_STATUS_OPT_UPDATE_INDEX;
+        char const * workdir = git_repository_workdir(&**lease);
+        if (options.pathspec.count || (options.flags & serialOnly) || !workdir) {
+            result.append(lease[git_status_list_new](&options));
+            return result;
+        }
+
+        // A fresh copy rather than the handle's own index, whose owner
+        // pointer the scans would otherwise fight over.
+        auto index = detail::wrap(git_index_open, (std::string{git_repository_path(&**lease)} + "index").c_str());
+
+        // Small trees aren't worth the extra scans.
+        size_t count = index[git_index_entrycount]();
+        size_t runs = std::min((threads.size() + 1) * 4, count / 1024);
+        if (runs < 2) {
+            result.append(lease[git_status_list_new](&options));
+            return result;
+        }
+        std::vector<std::string_view> tracked;
+        tracked.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            tracked.push_back(index[git_index_get_byindex](i)->path);
+        }
+        UniquePtr<git_tree> head;
+        if (options.baseline) {
+            head = detail::wrap(git_tree_dup, options.baseline);
+        } else if (!lease[git_repository_head_unborn]()) {
+            head = lease[git_revparse_single]("HEAD^{tree}").as<git_tree>();
+        }
+        detail::StatusPartitioner partitioner{workdir, head ? &*head : nullptr, std::max<size_t>(count / runs, 1)};
+        partitioner.split("", tracked);
+        auto & parts = partitioner.parts;
+
+        // Heaviest parts first, each to the lightest run so far.
+        std::sort(parts.begin(), parts.end(), [](auto & a, auto & b) { return a.weight > b.weight; });
+        runs = std::min(runs, parts.size());
+        std::vector<std::vector<char *>> specs(runs);
+        std::vector<size_t> load(runs);
+        for (auto & part : parts) {
+            size_t r = size_t(std::min_element(load.begin(), load.end()) - load.begin());
+            for (auto & path : part.paths) {
+                specs[r].push_back(path.data());
+            }
+            load[r] += part.weight;
+        }
+
+        std::vector<UniquePtr<git_status_list>> lists(runs);
+        bool icase;
+        {
+            // Whatever handles are free, up to one per thread. Taking more
+            // than one without blocking can't deadlock other callers.
+            std::vector<RepositoryPool::Lease> workers;
+            workers.push_back(std::move(lease));
+            while (workers.size() < std::min(runs, threads.size() + 1)) {
+                auto more = repos.tryLease();
+                if (!more) {
+                    break;
+                }
+                workers.push_back(std::move(*more));
+            }
+            // Attached one handle at a time before any scan starts, since
+            // each attach sets the index's owner. Undone on the way out.
+            struct Attach {
+                std::vector<RepositoryPool::Lease> & workers;
+                std::vector<UniquePtr<git_index>> originals;
+                ~Attach() {
+                    for (size_t i = 0; i < originals.size(); ++i) {
+                        git_repository_set_index(&**workers[i], &*originals[i]);
+                    }
+                }
+            } attach{workers, {}};
+            for (auto & worker : workers) {
+                auto original = worker[git_repository_index]();
+                check(worker[git_repository_set_index](&*index));
+                attach.originals.push_back(std::move(original));
+            }
+            check(index[git_index_set_caps](int(GIT_INDEX_CAPABILITY_FROM_OWNER)));
+            icase = (options.flags & GIT_STATUS_OPT_SORT_CASE_INSENSITIVELY) ||
+                    (!(options.flags & GIT_STATUS_OPT_SORT_CASE_SENSITIVELY) &&
+                     (index[git_index_caps]() & GIT_INDEX_CAPABILITY_IGNORE_CASE));
+            // Sorts the entries now, so that the scans' snapshots don't race to.
+            size_t pos;
+            git_index_find(&pos, &*index, "");
+
+            std::atomic<size_t> next{0};
+            threads.parallelFor(workers.size(), [&](size_t w) {
+                for (size_t r; (r = next++) < runs;) {
+                    auto o = options;
+                    o.flags |= GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH | GIT_STATUS_OPT_NO_REFRESH;
+                    o.pathspec = {specs[r].data(), specs[r].size()};
+                    lists[r] = workers[w][git_status_list_new](&o);
+                }
+            });
+        }
+        for (auto & list : lists) {
+            result.append(std::move(list));
+        }
+        auto less = [icase](git_status_entry const * a, git_status_entry const * b) {
+            auto p = reinterpret_cast<unsigned char const *>(StatusList::path(a));
+            auto q = reinterpret_cast<unsigned char const *>(StatusList::path(b));
+            auto fold = [icase](unsigned char c) { return icase && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; };
+            for (; *p && fold(*p) == fold(*q); ++p, ++q) {
+            }
+            return fold(*p) < fold(*q);
+        };
+        std::sort(result.entries_.begin(), result.entries_.end(), less);
+        return result;
+    }
+
+
+    struct CheckoutStats {
+        size_t files = 0;           // Files and symlinks written.
+        size_t directories = 0;
+        uint64_t bytes = 0;         // Content written, after filters.
+        double seconds = 0;
+
+        double filesPerSecond() const { return seconds > 0 ? double(files) / seconds : 0; }
+        double bytesPerSecond() const { return seconds > 0 ? double(bytes) / seconds : 0; }
+    };
+
+    struct CheckoutOptions {
+        // Where to write; the repository's working directory by default.
+        std::string directory;
+        // Replace the repository's index with the tree's entries, stat data
+        // included. Only meaningful when writing to the working directory.
+        bool writeIndex = true;
+        // Called with the totals so far and the number of files to write,
+        // every progressInterval files and once at the end. Calls come from
+        // the worker threads, one at a time.
+        std::function<void(CheckoutStats const & done, size_t total)> progress;
+        size_t progressInterval = 1024;
+    };
+
+    namespace detail {
+
+        // Whether git would check out a tree entry with this name. Rejects
+        // traversal and separators, and any name that a case-insensitive,
+        // NTFS or HFS+ filesystem would resolve to .git.
+        inline bool checkoutNameValid(std::string_view name) {
+            if (name.empty() || name == "." || name == ".." ||
+                name.find_first_of(std::string_view{"/\\\0", 3}) != name.npos) {
+                return false;
+            }
+            std::string folded;
+            for (size_t i = 0; i < name.size(); ++i) {
+                auto c = (unsigned char)name[i];
+                if (i + 2 < name.size()) {
+                    // HFS+ ignores these code points (U+200C-U+200F,
+                    // U+202A-U+202E, U+206A-U+206F, U+FEFF) in names.
+                    auto c1 = (unsigned char)name[i + 1], c2 = (unsigned char)name[i + 2];
+                    if ((c == 0xe2 && c1 == 0x80 && ((c2 >= 0x8c && c2 <= 0x8f) || (c2 >= 0xaa && c2 <= 0xae))) ||
+                        (c == 0xe2 && c1 == 0x81 && c2 >= 0xaa && c2 <= 0xaf) ||
+                        (c == 0xef && c1 == 0xbb && c2 == 0xbf)) {
+                        i += 2;
+                        continue;
+                    }
+                }
+                folded += char(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+            }
+            // NTFS drops trailing dots and spaces, and ':' starts a stream name.
+            folded.erase(std::min(folded.find(':'), folded.size()));
+            while (!folded.empty() && (folded.back() == '.' || folded.back() == ' ')) {
+                folded.pop_back();
+            }
+            return folded != ".git" && folded != "git~1";
+        }
+
+        struct CheckoutFile {
+            std::string path;
+            git_oid id;
+            git_filemode_t mode;
+            git_index_entry entry{};
+        };
+
+#if !defined(_WIN32)
+        inline bool writeAll(int fd, char const * data, size_t size) {
+            while (size) {
+                auto n = ::write(fd, data, size);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                data += n;
+                size -= size_t(n);
+            }
+            return true;
+        }
+
+        // Receives filtered content from git_filter_list_stream_blob.
+        struct FileSink : git_writestream {
+            explicit FileSink(int fd) : git_writestream{}, fd{fd} {
+                write = [](git_writestream * s, char const * buffer, size_t len) {
+                    auto sink = static_cast<FileSink *>(s);
+                    sink->bytes += len;
+                    return writeAll(sink->fd, buffer, len) ? 0 : -1;
+                };
+                close = [](git_writestream *) { return 0; };
+                free = [](git_writestream *) { };
+            }
+
+            int fd;
+            uint64_t bytes = 0;
+        };
+
+        // Writes one blob to root + f.path and fills in its index entry.
+        // Returns the number of bytes written.
+        inline uint64_t checkoutFile(UniquePtr<git_repository> & repo, std::string const & root, bool symlinks, CheckoutFile & f) {
+            auto full = root + f.path;
+            auto blob = repo[git_blob_lookup](&f.id);
+            uint64_t bytes = 0;
+            struct stat st;
+            if (f.mode == GIT_FILEMODE_LINK && symlinks) {
+                std::string target{blob.view()};
+                int rc = ::symlink(target.c_str(), full.c_str());
+                if (rc != 0 && errno == EEXIST && ::unlink(full.c_str()) == 0) {
+                    rc = ::symlink(target.c_str(), full.c_str());
+                }
+                if (rc != 0 || ::lstat(full.c_str(), &st) != 0) {
+                    throw Error{"checkout: can't create symlink " + f.path};
+                }
+                bytes = target.size();
+            } else {
+                // Never write through a symlink left at the path.
+                int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW;
+                mode_t perms = f.mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0777 : 0666;
+                int fd = ::open(full.c_str(), flags, perms);
+                if (fd < 0 && errno == ELOOP && ::unlink(full.c_str()) == 0) {
+                    fd = ::open(full.c_str(), flags, perms);
+                }
+                if (fd < 0) {
+                    throw Error{"checkout: can't create " + f.path};
+                }
+                bool ok;
+                auto filters = wrap(git_filter_list_load, &*repo, &*blob, f.path.c_str(), GIT_FILTER_TO_WORKTREE, GIT_FILTER_DEFAULT);
+                if (filters) {
+                    FileSink sink{fd};
+                    ok = call<FailsIfNegative>(git_filter_list_stream_blob, &*filters, &*blob, &sink) >= 0;
+                    bytes = sink.bytes;
+                } else {
+                    auto content = blob.view();
+                    ok = writeAll(fd, content.data(), content.size());
+                    bytes = content.size();
+                }
+                ok = ::fstat(fd, &st) == 0 && ok;
+                ok = ::close(fd) == 0 && ok;
+                if (!ok) {
+                    throw Error{"checkout: can't write " + f.path};
+                }
+            }
+            statEntry(f.entry, st);
+            return bytes;
+        }
+#endif
+
+    }
+
+    // Writes `tree` out as files, for checking a large snapshot out into an
+    // empty directory. The tree is walked once and its directories created up
+    // front. Blobs are then read in pack order and written across `threads`,
+    // each through a handle leased from `repos` and each through the filters
+    // for its path. Memory is bounded by one blob per worker. Finally the
+    // index is rebuilt in one batch. Unlike git_checkout_tree, nothing is
+    // compared or removed: existing files at the tree's paths are
+    // overwritten, and anything else is left alone. Entry names are checked
+    // as git checkout does, so a tree can't write outside the directory or
+    // into .git, but directories already present at the tree's paths are
+    // trusted; a symlink in their place is followed.
+    inline CheckoutStats checkoutFresh(RepositoryPool & repos, ThreadPool & threads, UniquePtr<git_tree> const & tree,
+                                       CheckoutOptions const & opts = {}) {
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+        CheckoutStats stats;
+        auto lease = repos.lease();
+        std::string root = opts.directory;
+        if (root.empty()) {
+            auto workdir = lease[git_repository_workdir]();
+            if (!workdir) {
+                throw Error{"checkout: repository has no working tree"};
+            }
+            root = workdir;
+        }
+        if (root.back() != '/') {
+            root += '/';
+        }
+
+#if !defined(_WIN32)
+        int symlinks = 1, ignoreCase = 0;
+        {
+            auto config = lease[git_repository_config_snapshot]();
+            if (detail::call<detail::FailsIfNegative>(git_config_get_bool, &symlinks, &*config, "core.symlinks") < 0) {
+                symlinks = 1;
+            }
+            if (detail::call<detail::FailsIfNegative>(git_config_get_bool, &ignoreCase, &*config, "core.ignorecase") < 0) {
+                ignoreCase = 0;
+            }
+        }
+
+        struct Walk {
+            std::string const & root;
+            bool ignoreCase;
+            std::vector<detail::CheckoutFile> files;
+            std::unordered_set<std::string> folded;
+            size_t directories = 0;
+        } walk{root, ignoreCase != 0};
+        std::error_code ec;
+        std::filesystem::create_directories(root, ec);
+        if (ec) {
+            throw Error{"checkout: can't create " + root};
+        }
+        // Pre-order, so each directory is made before its contents.
+        check(git_tree_walk(&*tree, GIT_TREEWALK_PRE, [](char const * dir, git_tree_entry const * e, void * p) {
+            auto & walk = *static_cast<Walk *>(p);
+            // Checked before anything is created; dir was checked on the way down.
+            char const * name = git_tree_entry_name(e);
+            if (!detail::checkoutNameValid(name)) {
+                giterr_set_str(GITERR_CHECKOUT, ("checkout: invalid path " + std::string{dir} + name).c_str());
+                return -1;
+            }
+            std::string path = std::string{dir} + name;
+            if (walk.ignoreCase) {
+                // Two entries would land on one file, written concurrently.
+                std::string folded = path;
+                for (auto & c : folded) {
+                    if (c >= 'A' && c <= 'Z') {
+                        c += 'a' - 'A';
+                    }
+                }
+                if (!walk.folded.insert(std::move(folded)).second) {
+                    giterr_set_str(GITERR_CHECKOUT, ("checkout: path collides with another when case is ignored: " + path).c_str());
+                    return -1;
+                }
+            }
+            auto mode = git_tree_entry_filemode(e);
+            if (mode == GIT_FILEMODE_TREE || mode == GIT_FILEMODE_COMMIT) {
+                if (::mkdir((walk.root + path).c_str(), 0777) != 0 && errno != EEXIST) {
+                    giterr_set_str(GITERR_OS, ("checkout: can't create directory " + path).c_str());
+                    return -1;
+                }
+                ++walk.directories;
+            }
+            if (mode != GIT_FILEMODE_TREE) {
+                walk.files.push_back({std::move(path), *git_tree_entry_id(e), mode});
+            }
+            return 0;
+        }, &walk));
+        auto & files = walk.files;
+        stats.directories = walk.directories;
+
+        // Submodules get an empty directory and an index entry, as git does.
+        std::vector<size_t> blobs;
+        std::vector<git_oid> ids;
+        blobs.reserve(files.size());
+        ids.reserve(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].mode != GIT_FILEMODE_COMMIT) {
+                blobs.push_back(i);
+                ids.push_back(files[i].id);
+            }
+        }
+        auto order = detail::packOrder(&**lease, ids).second;
+        lease.release();
+
+        std::atomic<size_t> done{0};
+        std::atomic<uint64_t> bytes{0};
+        std::mutex progressMutex;
+        size_t interval = std::max<size_t>(opts.progressInterval, 1);
+        size_t runs = std::min(blobs.size(), (threads.size() + 1) * 4);
+        threads.parallelFor(runs, [&](size_t r) {
+            auto worker = repos.lease();
+            for (size_t k = r * order.size() / runs, end = (r + 1) * order.size() / runs; k < end; ++k) {
+                bytes += detail::checkoutFile(*worker, root, symlinks != 0, files[blobs[order[k]]]);
+                size_t n = ++done;
+                if (opts.progress && n % interval == 0) {
+                    std::lock_guard<std::mutex> lock{progressMutex};
+                    CheckoutStats now{n, stats.directories, bytes, elapsed()};
+                    opts.progress(now, blobs.size());
+                }
+            }
+        });
+        stats.files = blobs.size();
+        stats.bytes = bytes;
+
+        if (opts.writeIndex) {
+            // In index order, so each entry is appended.
+            std::sort(files.begin(), files.end(), [](auto & a, auto & b) { return a.path < b.path; });
+            auto owner = repos.lease();
+            auto index = owner[git_repository_index]();
+            check(index[git_index_clear]());
+            for (auto & f : files) {
+                f.entry.mode = f.mode;
+                f.entry.id = f.id;
+                f.entry.path = f.path.c_str();
+                check(detail::call<detail::FailsIfNegative>(git_index_add, &*index, &f.entry));
+            }
+            check(index[git_index_write]());
+        }
+#else
+        // No POSIX file APIs; let libgit2 do it.
+        (void)threads;
+        git_checkout_options co = GIT_CHECKOUT_OPTIONS_INIT;
+        co.checkout_strategy = GIT_CHECKOUT_FORCE | (opts.writeIndex ? 0 : GIT_CHECKOUT_DONT_UPDATE_INDEX);
+        co.target_directory = root.c_str();
+        check(lease[git_checkout_tree](reinterpret_cast<git_object const *>(&*tree), &co));
+        check(git_tree_walk(&*tree, GIT_TREEWALK_PRE, [](char const *, git_tree_entry const * e, void * p) {
+            auto & stats = *static_cast<CheckoutStats *>(p);
+            ++(git_tree_entry_type(e) == GIT_OBJ_TREE ? stats.directories : stats.files);
+            return 0;
+        }, &stats));
+#endif
+        stats.seconds = elapsed();
+        if (opts.progress) {
+            opts.progress(stats, stats.files);
+        }
+        return stats;
+    }
+
+
+    namespace detail {
+
+        // Matches one pattern token (a literal, '?', "\x" or a [...] class)
+        // at pattern[p] against c, advancing p past it.
+        inline bool globMatchOne(std::string_view pattern, size_t & p, unsigned char c) {
+            unsigned char t = pattern[p++];
+            if (t == '?') {
+                return true;
+            }
+            if (t == '\\' && p < pattern.size()) {
+                return (unsigned char)pattern[p++] == c;
+            }
+            if (t == '[') {
+                size_t q = p;
+                bool negate = q < pattern.size() && (pattern[q] == '!' || pattern[q] == '^');
+                q += negate;
+                bool matched = false;
+                for (bool first = true; q < pattern.size() && (first || pattern[q] != ']'); first = false) {
+                    unsigned char lo = pattern[q++];
+                    unsigned char hi = lo;
+                    if (q + 1 < pattern.size() && pattern[q] == '-' && pattern[q + 1] != ']') {
+                        hi = pattern[q + 1];
+                        q += 2;
+                    }
+                    matched |= lo <= c && c <= hi;
+                }
+                if (q >= pattern.size()) {
+                    return c == '[';    // Unterminated: a literal '['.
+                }
+                p = q + 1;
+                return matched != negate;
+            }
+            return t == c;
+        }
+
+        // Shell-style glob match as git applies to ref names: '*' matches any
+        // run of characters, '/' included.
+        inline bool globMatch(std::string_view pattern, std::string_view text) {
+            size_t p = 0, t = 0;
+            size_t starP = std::string_view::npos, starT = 0;
+            while (t < text.size()) {
+                if (p < pattern.size() && pattern[p] == '*') {
+                    starP = ++p;
+                    starT = t;
+                    continue;
+                }
+                size_t next = p;
+                if (p < pattern.size() && globMatchOne(pattern, next, text[t])) {
+                    p = next;
+                    ++t;
+                    continue;
+                }
+                if (starP == std::string_view::npos) {
+                    return false;
+                }
+                p = starP;
+                t = ++starT;
+            }
+            while (p < pattern.size() && pattern[p] == '*') {
+                ++p;
+            }
+            return p == pattern.size();
+        }
+
+    }
+
+    // Every ref under refs/ in one sorted array, for repositories with more
+    // refs than iterating git_reference_next can handle per query. Names
+    // point into the mapped packed-refs file or the snapshot's copies of
+    // loose refs, so lookups, prefix and glob queries are binary searches that
+    // allocate nothing. Reads the files ref backend directly, from the common
+    // dir, so per-worktree refs are not included. refresh() picks up changes.
+    class RefSnapshot {
+    public:
+        struct Ref {
+            std::string_view name;
+            std::string_view symbolic;  // The ref it points to, if symbolic.
+            git_oid target;             // Symbolic refs resolved; zero if dangling.
+        };
+
+        // Refs from a contiguous run of the snapshot, optionally filtered by a glob.
+        class Range {
+        public:
+            class iterator {
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = Ref;
+                using difference_type = std::ptrdiff_t;
+                using pointer = Ref const *;
+                using reference = Ref const &;
+
+                Ref const & operator*() const { return *p_; }
+                Ref const * operator->() const { return p_; }
+
+                iterator & operator++() {
+                    ++p_;
+                    skip();
+                    return *this;
+                }
+                iterator operator++(int) {
+                    auto i = *this;
+                    ++*this;
+                    return i;
+                }
+
+                bool operator==(iterator const & that) const { return p_ == that.p_; }
+                bool operator!=(iterator const & that) const { return p_ != that.p_; }
+
+            private:
+                friend Range;
+
+                Ref const * p_;
+                Range const * range_;
+
+                iterator(Ref const * p, Range const * range) : p_{p}, range_{range} { skip(); }
+
+                void skip() {
+                    if (range_->glob_) {
+                        while (p_ != range_->last_ && !detail::globMatch(range_->pattern_, p_->name)) {
+                            ++p_;
+                        }
+                    }
+                }
+            };
+
+            iterator begin() const { return {first_, this}; }
+            iterator end() const { return {last_, this}; }
+            bool empty() const { return begin() == end(); }
+
+        private:
+            friend RefSnapshot;
+
+            Ref const * first_;
+            Ref const * last_;
+            std::string_view pattern_;
+            bool glob_;
+
+            Range(Ref const * first, Ref const * last, std::string_view pattern, bool glob)
+            : first_{first}, last_{last}, pattern_{pattern}, glob_{glob} { }
+        };
+
+        explicit RefSnapshot(UniquePtr<git_repository> const & repo) : dir_{git_repository_commondir(&*repo)} {
+            refresh();
+        }
+
+        // Names point into the snapshot's own storage.
+        RefSnapshot(RefSnapshot const &) = delete;
+        RefSnapshot & operator=(RefSnapshot const &) = delete;
+        RefSnapshot(RefSnapshot &&) = default;
+        RefSnapshot & operator=(RefSnapshot &&) = default;
+
+        size_t size() const { return refs_.size(); }
+        Ref const * begin() const { return refs_.data(); }
+        Ref const * end() const { return refs_.data() + refs_.size(); }
+
+        // Null if absent.
+        Ref const * find(std::string_view name) const {
+            auto i = std::lower_bound(begin(), end(), name, [](Ref const & r, std::string_view n) { return r.name < n; });
+            return i != end() && i->name == name ? i : nullptr;
+        }
+
+        Range prefix(std::string_view prefix) const {
+            auto first = std::lower_bound(begin(), end(), prefix, [](Ref const & r, std::string_view p) { return r.name < p; });
+            auto last = std::partition_point(first, end(), [&](Ref const & r) { return r.name.substr(0, prefix.size()) == prefix; });
+            return {first, last, {}, false};
+        }
+
+        // Glob over names (see git_reference_iterator_glob_new). Only the refs
+        // sharing the pattern's literal prefix are tested. `pattern` must
+        // outlive the range.
+        Range glob(std::string_view pattern) const {
+            auto range = prefix(pattern.substr(0, pattern.find_first_of("*?[\\")));
+            range.pattern_ = pattern;
+            range.glob_ = true;
+            return range;
+        }
+
+        // Re-reads what changed on disk since the last load: packed-refs if it
+        // was replaced, and loose refs only in directories whose mtime moved
+        // (git updates loose refs by renaming into place, which touches the
+        // directory). Returns true if the snapshot changed.
+        bool refresh() {
+            bool changed = refreshPacked();
+            changed |= refreshLoose("refs");
+            if (changed) {
+                rebuild();
+            }
+            return changed;
+        }
+
+    private:
+        struct Stamp {
+            bool exists = false;
+            std::filesystem::file_time_type time{};
+            uintmax_t size = 0;
+
+            bool operator==(Stamp const & that) const {
+                return exists == that.exists && time == that.time && size == that.size;
+            }
+            bool operator!=(Stamp const & that) const { return !(*this == that); }
+        };
+
+        struct LooseRef {
+            std::string name;
+            std::string symbolic;
+            git_oid id;
+
+            bool operator==(LooseRef const & that) const {
+                return name == that.name && symbolic == that.symbolic && git_oid_equal(&id, &that.id);
+            }
+        };
+
+        struct LooseDir {
+            Stamp stamp;
+            bool racy = false;      // Changed too recently for its mtime to be trusted.
+            std::vector<LooseRef> refs;
+            std::vector<std::string> subdirs;
+        };
+
+        std::filesystem::path dir_;
+        Stamp packedStamp_;
+        bool packedRacy_ = false;
+        detail::Mapping packed_;
+        std::vector<Ref> packedRefs_;
+        std::map<std::string, LooseDir> loose_;     // By directory, relative to dir_.
+        std::vector<Ref> refs_;
+
+        static Stamp stamp(std::filesystem::path const & path, bool & racy) {
+            std::error_code ec;
+            Stamp s;
+            s.time = std::filesystem::last_write_time(path, ec);
+            if (ec) {
+                racy = false;
+                return {};
+            }
+            s.exists = true;
+            if (!std::filesystem::is_directory(path, ec)) {
+                s.size = std::filesystem::file_size(path, ec);
+            }
+            racy = std::filesystem::file_time_type::clock::now() - s.time < std::chrono::seconds(2);
+            return s;
+        }
+
+        bool refreshPacked() {
+            bool racy;
+            auto path = dir_ / "packed-refs";
+            auto s = stamp(path, racy);
+            if (s == packedStamp_ && !packedRacy_) {
+                return false;
+            }
+            packedStamp_ = s;
+            packedRacy_ = racy;
+            detail::Mapping packed;
+            if (s.exists) {
+                try {
+                    packed = detail::mapFile(path.string());
+                } catch (Error const &) {
+                    // Replaced as we looked; the next refresh will see the new one.
+                    packedRacy_ = true;
+                    return false;
+                }
+            }
+            std::vector<Ref> refs;
+            auto p = static_cast<char const *>(packed.data);
+            auto end = p + packed.size;
+            while (p < end) {
+                auto eol = static_cast<char const *>(std::memchr(p, '\n', size_t(end - p)));
+                eol = eol ? eol : end;
+                std::string_view line{p, size_t(eol - p)};
+                p = eol + 1;
+                if (!line.empty() && line.back() == '\r') {
+                    line.remove_suffix(1);
+                }
+                // "<oid> <name>", skipping the header and "^<peeled>" lines.
+                git_oid id;
+                if (line.size() > GIT_OID_HEXSZ + 1 && line[GIT_OID_HEXSZ] == ' ' &&
+                    git_oid_fromstrn(&id, line.data(), GIT_OID_HEXSZ) == 0) {
+                    refs.push_back({line.substr(GIT_OID_HEXSZ + 1), {}, id});
+                }
+            }
+            sortByName(refs);
+            auto same = [](Ref const & a, Ref const & b) { return a.name == b.name && git_oid_equal(&a.target, &b.target); };
+            if (std::equal(refs.begin(), refs.end(), packedRefs_.begin(), packedRefs_.end(), same)) {
+                return false;
+            }
+            packed_ = std::move(packed);
+            packedRefs_ = std::move(refs);
+            return true;
+        }
+
+        // Rescans `rel` if its mtime moved, then recurses into its subdirectories.
+        bool refreshLoose(std::string const & rel) {
+            bool racy;
+            auto s = stamp(dir_ / rel, racy);
+            if (!s.exists) {
+                return eraseLoose(rel);
+            }
+            bool changed = false;
+            auto & d = loose_[rel];
+            if (s != d.stamp || d.racy) {
+                std::vector<LooseRef> refs;
+                std::vector<std::string> subdirs;
+                std::error_code ec;
+                for (auto & entry : std::filesystem::directory_iterator{dir_ / rel, ec}) {
+                    auto name = entry.path().filename().string();
+                    auto type = entry.symlink_status(ec).type();
+                    if (type == std::filesystem::file_type::directory) {
+                        subdirs.push_back(name);
+                    } else if (type == std::filesystem::file_type::regular) {
+                        LooseRef ref{rel + "/" + name, {}, {}};
+                        if (readLoose(entry.path(), ref)) {
+                            refs.push_back(std::move(ref));
+                        }
+                    }
+                }
+                std::sort(refs.begin(), refs.end(), [](LooseRef const & a, LooseRef const & b) { return a.name < b.name; });
+                std::sort(subdirs.begin(), subdirs.end());
+                for (auto & old : d.subdirs) {
+                    if (!std::binary_search(subdirs.begin(), subdirs.end(), old)) {
+                        changed |= eraseLoose(rel + "/" + old);
+                    }
+                }
+                // Keep the old strings if nothing changed; the snapshot views them.
+                if (refs != d.refs) {
+                    d.refs = std::move(refs);
+                    changed = true;
+                }
+                d.stamp = s;
+                d.racy = racy;
+                d.subdirs = std::move(subdirs);
+            }
+            for (auto & sub : std::vector<std::string>{d.subdirs}) {
+                changed |= refreshLoose(rel + "/" + sub);
+            }
+            return changed;
+        }
+
+        // Forgets `rel` and everything below it.
+        bool eraseLoose(std::string const & rel) {
+            bool changed = false;
+            for (auto i = loose_.lower_bound(rel); i != loose_.end() && i->first.compare(0, rel.size(), rel) == 0;) {
+                if (i->first.size() == rel.size() || i->first[rel.size()] == '/') {
+                    changed |= !i->second.refs.empty();
+                    i = loose_.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            return changed;
+        }
+
+        // "<oid>" or "ref: <name>"; anything else (e.g. a lock file) is skipped.
+        static bool readLoose(std::filesystem::path const & path, LooseRef & ref) {
+            char buf[512];
+            std::unique_ptr<FILE, int (*)(FILE *)> f{std::fopen(path.string().c_str(), "rb"), &std::fclose};
+            size_t n = f ? std::fread(buf, 1, sizeof(buf), f.get()) : 0;
+            std::string_view s{buf, n};
+            while (!s.empty() && (s.back() == '\n' || s.back() == '\r' || s.back() == ' ')) {
+                s.remove_suffix(1);
+            }
+            if (s.substr(0, 5) == "ref: ") {
+                ref.symbolic = std::string{s.substr(5)};
+                return !ref.symbolic.empty();
+            }
+            return s.size() == GIT_OID_HEXSZ && git_oid_fromstrn(&ref.id, s.data(), GIT_OID_HEXSZ) == 0;
+        }
+
+        static void sortByName(std::vector<Ref> & refs) {
+            auto byName = [](Ref const & a, Ref const & b) { return a.name < b.name; };
+            if (!std::is_sorted(refs.begin(), refs.end(), byName)) {
+                std::sort(refs.begin(), refs.end(), byName);
+            }
+        }
+
+        // Merges the packed and loose refs (loose ones win), then resolves
+        // symbolic refs.
+        void rebuild() {
+            std::vector<Ref> loose;
+            for (auto & d : loose_) {
+                for (auto & r : d.second.refs) {
+                    loose.push_back({r.name, r.symbolic, r.id});
+                }
+            }
+            sortByName(loose);
+            refs_.clear();
+            refs_.reserve(packedRefs_.size() + loose.size());
+            auto p = packedRefs_.begin();
+            for (auto & l : loose) {
+                for (; p != packedRefs_.end() && p->name < l.name; ++p) {
+                    refs_.push_back(*p);
+                }
+                if (p != packedRefs_.end() && p->name == l.name) {
+                    ++p;
+                }
+                refs_.push_back(l);
+            }
+            refs_.insert(refs_.end(), p, packedRefs_.end());
+            for (auto & r : refs_) {
+                Ref const * target = &r;
+                for (int depth = 0; target && !target->symbolic.empty() && depth < 5; ++depth) {
+                    target = find(target->symbolic);
+                }
+                if (&r != target) {
+                    r.target = target && target->symbolic.empty() ? target->target : git_oid{};
+                }
+            }
+        }
+    };
+
+#if LIBGIT2PP_HAVE_ODB_BACKEND_DATA
+    // Base for custom object stores. Subclasses answer lookups, and
+    // addBackend() attaches them to a git_odb. With a shared odb (libgit2 >=
+    // 1.2), methods are called from several threads at once. Lookups return
+    // false for missing objects. Errors are thrown, and libgit2 reports them
+    // to its caller with the exception's message.
+    class OdbBackend {
     public:
-        StructIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
-        StructIterator() = default;
+        // Where read() puts an object's content. libgit2 takes ownership of it.
+        class Buffer {
+        public:
+            void * allocate(size_t size) {
+                release();
+                data_ = git_odb_backend_data_alloc(backend_, size ? size : 1);
+                if (!data_) {
+                    throw std::bad_alloc{};
+                }
+                size_ = size;
+                return data_;
+            }
 
-        void increment(int & rc) {
-            T t;
-            if ((rc = base::next_(&t, &**base::i_)) == 0) {
-                t_ = t;
+            void assign(void const * data, size_t size) {
+                if (size) {
+                    std::memcpy(allocate(size), data, size);
+                } else {
+                    allocate(0);
+                }
+            }
+
+        private:
+            friend class OdbBackend;
+
+            git_odb_backend * backend_;
+            void * data_ = nullptr;
+            size_t size_ = 0;
+
+            explicit Buffer(git_odb_backend * backend) : backend_{backend} { }
+            ~Buffer() { release(); }
+
+            void release() {
+                if (data_) {
+                    git_odb_backend_data_free(backend_, data_);
+                    data_ = nullptr;
+                }
             }
+        };
+
+        virtual ~OdbBackend() = default;
+
+        virtual bool read(git_oid const & id, git_otype & type, Buffer & content) = 0;
+        virtual bool readHeader(git_oid const & id, git_otype & type, size_t & size) = 0;
+
+        virtual bool exists(git_oid const & id) {
+            git_otype type;
+            size_t size;
+            return readHeader(id, type, size);
         }
 
-        T operator*() const { return t_; }
-        T & operator->() const { return t_; }
+        // Calls f with each object's id until it returns false.
+        virtual void forEach(std::function<bool(git_oid const &)> const & f) = 0;
+
+        // Backends that return false here never see write().
+        virtual bool writable() const { return false; }
+        virtual void write(git_oid const &, void const *, size_t, git_otype) {
+            throw Error{"odb backend is read-only"};
+        }
+
+        // Called when a lookup misses everywhere, before libgit2 retries.
+        virtual void refresh() { }
 
     private:
-        mutable T t_;
-        friend base;
+        friend void addBackend(UniquePtr<git_odb> const & odb, std::shared_ptr<OdbBackend> backend, int priority);
+
+        // The git_odb_backend that libgit2 owns. It keeps the backend alive.
+        struct Shim {
+            git_odb_backend parent;
+            std::shared_ptr<OdbBackend> backend;
+
+            static OdbBackend & get(git_odb_backend * b) { return *reinterpret_cast<Shim *>(b)->backend; }
+
+            // Exceptions can't cross libgit2, so they become error codes.
+            template <typename F>
+            static int guard(F && f) {
+                try {
+                    return f();
+                } catch (std::exception const & e) {
+                    giterr_set_str(GITERR_ODB, e.what());
+                } catch (...) {
+                    giterr_set_str(GITERR_ODB, "unknown exception in odb backend");
+                }
+                return GIT_ERROR;
+            }
+
+            static int read(void ** data, size_t * size, git_otype * type, git_odb_backend * b, git_oid const * id) {
+                return guard([&] {
+                    Buffer buffer{b};
+                    if (!get(b).read(*id, *type, buffer)) {
+                        return int(GIT_ENOTFOUND);
+                    }
+                    if (!buffer.data_) {
+                        buffer.allocate(0);
+                    }
+                    *data = buffer.data_;
+                    *size = buffer.size_;
+                    buffer.data_ = nullptr;
+                    return 0;
+                });
+            }
+
+            static int readHeader(size_t * size, git_otype * type, git_odb_backend * b, git_oid const * id) {
+                return guard([&] { return get(b).readHeader(*id, *type, *size) ? 0 : int(GIT_ENOTFOUND); });
+            }
+
+            // libgit2 reads any nonzero result as "exists", so failures
+            // can't go through guard().
+            static int exists(git_odb_backend * b, git_oid const * id) {
+                try {
+                    return int(get(b).exists(*id));
+                } catch (std::exception const & e) {
+                    giterr_set_str(GITERR_ODB, e.what());
+                } catch (...) {
+                    giterr_set_str(GITERR_ODB, "unknown exception in odb backend");
+                }
+                return 0;
+            }
+
+            static int forEach(git_odb_backend * b, git_odb_foreach_cb cb, void * payload) {
+                return guard([&] {
+                    int rc = 0;
+                    get(b).forEach([&](git_oid const & id) { return (rc = cb(&id, payload)) == 0; });
+                    return rc;
+                });
+            }
+
+            static int write(git_odb_backend * b, git_oid const * id, void const * data, size_t size, git_otype type) {
+                return guard([&] {
+                    get(b).write(*id, data, size, type);
+                    return 0;
+                });
+            }
+
+            static int refresh(git_odb_backend * b) {
+                return guard([&] {
+                    get(b).refresh();
+                    return 0;
+                });
+            }
+
+            static void free(git_odb_backend * b) { delete reinterpret_cast<Shim *>(b); }
+        };
     };
 
-    template <typename I, typename NextF>
-    class BranchIterator : public IteratorBase<I, NextF, BranchIterator<I, NextF>> {
-    private:
-        using base = IteratorBase<I, NextF, BranchIterator>;
+    // Attaches `backend` to `odb`. Lookups try backends in descending
+    // priority; libgit2's own loose and pack backends are 1 and 2, so use 3 or
+    // more to be consulted first. A backend may be attached to several odbs.
+    inline void addBackend(UniquePtr<git_odb> const & odb, std::shared_ptr<OdbBackend> backend, int priority) {
+        using Shim = OdbBackend::Shim;
+        auto shim = std::make_unique<Shim>();
+        check(git_odb_init_backend(&shim->parent, GIT_ODB_BACKEND_VERSION));
+        shim->parent.read = &Shim::read;
+        shim->parent.read_header = &Shim::readHeader;
+        shim->parent.exists = &Shim::exists;
+        shim->parent.foreach = &Shim::forEach;
+        shim->parent.refresh = &Shim::refresh;
+        shim->parent.free = &Shim::free;
+        if (backend->writable()) {
+            shim->parent.write = &Shim::write;
+        }
+        shim->backend = std::move(backend);
+        check(git_odb_add_backend(&*odb, &shim->parent, priority));
+        shim.release();
+    }
+
+    // Objects held in memory, for ephemeral repositories and fixtures.
+    // Writable: objects written through the odb land here.
+    class MemoryOdb : public OdbBackend {
     public:
-        struct Entry {
-            Entry() = default;
-            Entry(Entry const &) = delete;
-            Entry& operator=(Entry const &) = delete;
-            Entry(Entry &&) = default;
-            Entry& operator=(Entry &&) = default;
+        git_oid insert(void const * data, size_t size, git_otype type) {
+            git_oid id;
+            check(git_odb_hash(&id, data, size, type));
+            write(id, data, size, type);
+            return id;
+        }
 
-            UniquePtr<git_reference> ref;
-            git_branch_t type;
-        };
+        git_oid insert(std::string_view data, git_otype type) { return insert(data.data(), data.size(), type); }
 
-        BranchIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
-        BranchIterator() = default;
+        size_t size() const {
+            std::shared_lock<std::shared_mutex> lock{mutex_};
+            return objects_.size();
+        }
 
-        void increment(int & rc) {
-            git_reference * ref;
-            git_branch_t type;
-            if ((rc = base::next_(&ref, &type, &**base::i_)) == 0) {
-                e_ = {std::move(ref), type};
+        void clear() {
+            std::unique_lock<std::shared_mutex> lock{mutex_};
+            objects_.clear();
+        }
+
+        bool read(git_oid const & id, git_otype & type, Buffer & content) override {
+            std::shared_lock<std::shared_mutex> lock{mutex_};
+            auto o = objects_.find(id);
+            if (!o) {
+                return false;
             }
+            type = o->type;
+            content.assign(o->data.data(), o->data.size());
+            return true;
         }
 
-        Entry const & operator*() const { return e_; }
-        Entry const * operator->() const { return &e_; }
+        bool readHeader(git_oid const & id, git_otype & type, size_t & size) override {
+            std::shared_lock<std::shared_mutex> lock{mutex_};
+            auto o = objects_.find(id);
+            if (!o) {
+                return false;
+            }
+            type = o->type;
+            size = o->data.size();
+            return true;
+        }
+
+        bool exists(git_oid const & id) override {
+            std::shared_lock<std::shared_mutex> lock{mutex_};
+            return objects_.contains(id);
+        }
+
+        void forEach(std::function<bool(git_oid const &)> const & f) override {
+            std::vector<git_oid> ids;
+            {
+                std::shared_lock<std::shared_mutex> lock{mutex_};
+                ids.reserve(objects_.size());
+                for (auto & o : objects_) {
+                    ids.push_back(o.key);
+                }
+            }
+            for (auto & id : ids) {
+                if (!f(id)) {
+                    break;
+                }
+            }
+        }
+
+        bool writable() const override { return true; }
+
+        void write(git_oid const & id, void const * data, size_t size, git_otype type) override {
+            std::unique_lock<std::shared_mutex> lock{mutex_};
+            objects_.insert(id, {type, std::string{static_cast<char const *>(data), size}});
+        }
 
     private:
-        Entry e_;
-        friend base;
+        struct Object {
+            git_otype type;
+            std::string data;
+        };
+
+        mutable std::shared_mutex mutex_;
+        OidMap<Object> objects_;
     };
 
-    template <typename I, typename NextF>
-    class IndexConflictIterator : public IteratorBase<I, NextF, IndexConflictIterator<I, NextF>> {
-    private:
-        using base = IteratorBase<I, NextF, IndexConflictIterator>;
+    // A read-only file of objects sorted by oid and stored uncompressed, to
+    // layer ahead of the packfiles for objects that are read over and over.
+    // Lookups are a fanout step and a binary search in the mapped file.
+    // find() returns views into the mapping; reads through libgit2 copy once
+    // into the buffer it owns, instead of inflating and resolving deltas.
+    class HotObjectFile : public OdbBackend {
     public:
-        struct Entry {
-            git_index_entry const * ancestor;
-            git_index_entry const * our;
-            git_index_entry const * their;
+        struct Object {
+            git_otype type;
+            std::string_view data;
         };
 
-        IndexConflictIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
-        IndexConflictIterator() = default;
+        explicit HotObjectFile(std::string const & path) : storage_{detail::mapFile(path)} {
+            auto base = static_cast<char const *>(storage_.data);
+            uint32_t order, ver;
+            uint64_t count;
+            if (storage_.size < tableOffset || std::memcmp(base, magic, sizeof(magic)) != 0) {
+                throw Error{"HotObjectFile: not an object file: " + path};
+            }
+            std::memcpy(&order, base + 8, 4);
+            std::memcpy(&ver, base + 12, 4);
+            std::memcpy(&count, base + 16, 8);
+            if (order != byteOrder || ver != version || count > (storage_.size - tableOffset) / sizeof(Entry)) {
+                throw Error{"HotObjectFile: incompatible or corrupt file: " + path};
+            }
+            fanout_ = reinterpret_cast<uint32_t const *>(base + headerSize);
+            entries_ = reinterpret_cast<Entry const *>(base + tableOffset);
+            count_ = size_t(count);
+            // Lookups trust the fanout to bound their search of entries_.
+            for (size_t b = 0; b < 256; ++b) {
+                if (fanout_[b] > count_ || (b > 0 && fanout_[b] < fanout_[b - 1])) {
+                    throw Error{"HotObjectFile: corrupt fanout: " + path};
+                }
+            }
+            if (fanout_[255] != count_) {
+                throw Error{"HotObjectFile: corrupt fanout: " + path};
+            }
+        }
 
-        void increment(int & rc) {
-            Entry e;
-            if ((rc = base::next_(&e.ancestor, &e.our, &e.their, &**base::i_)) == 0) {
-                e_ = e;
+        // Writes the objects `ids` from `odb`, replacing `path` atomically so
+        // that processes still mapping the old file are unaffected.
+        static void write(std::string const & path, UniquePtr<git_odb> const & odb, std::vector<git_oid> ids) {
+            std::sort(ids.begin(), ids.end(), [](git_oid const & a, git_oid const & b) { return git_oid_cmp(&a, &b) < 0; });
+            ids.erase(std::unique(ids.begin(), ids.end(), [](git_oid const & a, git_oid const & b) { return git_oid_equal(&a, &b); }), ids.end());
+
+            std::vector<char> head(tableOffset + ids.size() * sizeof(Entry));
+            auto fanout = reinterpret_cast<uint32_t *>(head.data() + headerSize);
+            auto entries = reinterpret_cast<Entry *>(head.data() + tableOffset);
+            uint64_t count = ids.size();
+            std::memcpy(head.data(), magic, sizeof(magic));
+            std::memcpy(head.data() + 8, &byteOrder, 4);
+            std::memcpy(head.data() + 12, &version, 4);
+            std::memcpy(head.data() + 16, &count, 8);
+
+            auto tmp = path + ".tmp";
+            std::unique_ptr<FILE, int (*)(FILE *)> f{std::fopen(tmp.c_str(), "wb"), &std::fclose};
+            bool ok = f && std::fseek(f.get(), long(head.size()), SEEK_SET) == 0;
+            uint64_t offset = head.size();
+            try {
+                for (size_t i = 0; ok && i < ids.size(); ++i) {
+                    auto object = odb[git_odb_read](&ids[i]);
+                    auto data = object.view();
+                    entries[i] = {ids[i], uint32_t(object[git_odb_object_type]()), offset, data.size()};
+                    ++fanout[ids[i].id[0]];
+                    ok = std::fwrite(data.data(), 1, data.size(), f.get()) == data.size();
+                    offset += data.size();
+                }
+            } catch (...) {
+                // E.g. an id missing from odb; don't leave the partial file.
+                f.reset();
+                std::error_code ec;
+                std::filesystem::remove(tmp, ec);
+                throw;
+            }
+            for (size_t b = 1; b < 256; ++b) {
+                fanout[b] += fanout[b - 1];
+            }
+            ok = ok && std::fseek(f.get(), 0, SEEK_SET) == 0 &&
+                std::fwrite(head.data(), 1, head.size(), f.get()) == head.size() && std::fflush(f.get()) == 0;
+            ok = f && std::fclose(f.release()) == 0 && ok;
+            std::error_code ec;
+            if (ok) {
+                std::filesystem::rename(tmp, path, ec);
+            }
+            if (!ok || ec) {
+                std::filesystem::remove(tmp, ec);
+                throw Error{"HotObjectFile: can't write " + path};
             }
         }
 
-        Entry const & operator*() const { return e_; }
-        Entry const * operator->() const { return &e_; }
+        size_t size() const { return count_; }
 
-    private:
-        Entry e_;
-        friend base;
-    };
+        std::optional<Object> find(git_oid const & id) const {
+            auto e = entry(id);
+            if (!e) {
+                return std::nullopt;
+            }
+            return Object{git_otype(e->type), {static_cast<char const *>(storage_.data) + e->offset, size_t(e->size)}};
+        }
+
+        bool read(git_oid const & id, git_otype & type, Buffer & content) override {
+            auto o = find(id);
+            if (!o) {
+                return false;
+            }
+            type = o->type;
+            content.assign(o->data.data(), o->data.size());
+            return true;
+        }
+
+        bool readHeader(git_oid const & id, git_otype & type, size_t & size) override {
+            auto e = entry(id);
+            if (!e) {
+                return false;
+            }
+            type = git_otype(e->type);
+            size = size_t(e->size);
+            return true;
+        }
+
+        bool exists(git_oid const & id) override { return entry(id) != nullptr; }
+
+        void forEach(std::function<bool(git_oid const &)> const & f) override {
+            for (size_t i = 0; i < count_; ++i) {
+                if (!f(entries_[i].id)) {
+                    break;
+                }
+            }
+        }
 
-    template <typename I, typename NextF>
-    class NoteIterator : public IteratorBase<I, NextF, NoteIterator<I, NextF>> {
     private:
-        using base = IteratorBase<I, NextF, NoteIterator>;
-    public:
+        // A 64-byte header, the fanout, then an Entry per object sorted by
+        // oid, then the objects' content, in native byte order.
         struct Entry {
-            git_oid note_id;
-            git_oid annotated_id;
+            git_oid id;
+            uint32_t type;
+            uint64_t offset;
+            uint64_t size;
         };
+        static_assert(sizeof(Entry) == 40, "HotObjectFile::Entry must match the file layout");
 
-        NoteIterator(UniquePtr<I> * i, NextF next) : base{i, std::move(next)} { ++*this; }
-        NoteIterator() = default;
+        static constexpr char magic[8] = {'G', '2', 'P', 'P', 'H', 'O', 'T', 'O'};
+        static constexpr uint32_t byteOrder = 0x01020304;
+        static constexpr uint32_t version = 1;
+        static constexpr size_t headerSize = 64;
+        static constexpr size_t tableOffset = headerSize + 256 * sizeof(uint32_t);
 
-        void increment(int & rc) {
-            Entry e;
-            if ((rc = base::next_(&e.note_id, &e.annotated_id, &**base::i_)) == 0) {
-                e_ = e;
+        detail::Mapping storage_;
+        uint32_t const * fanout_;
+        Entry const * entries_;
+        size_t count_;
+
+        Entry const * entry(git_oid const & id) const {
+            uint8_t b = id.id[0];
+            auto first = entries_ + (b ? fanout_[b - 1] : 0);
+            auto last = entries_ + fanout_[b];
+            auto e = std::lower_bound(first, last, id, [](Entry const & e, git_oid const & id) { return git_oid_cmp(&e.id, &id) < 0; });
+            if (e == last || !git_oid_equal(&e->id, &id) || e->offset > storage_.size || e->size > storage_.size - e->offset) {
+                return nullptr;
             }
+            return e;
         }
+    };
+#endif
 
-        Entry const & operator*() const { return e_; }
-        Entry const * operator->() const { return &e_; }
+    struct PackStats {
+        size_t objects = 0;
+        uint64_t bytes = 0;         // Delivered to the sink.
+        double insertSeconds = 0;   // Adding objects (walking commits and trees).
+        double deltaSeconds = 0;    // Finding deltas and compressing.
+        double writeSeconds = 0;    // Streaming to the sink.
 
-    private:
-        Entry e_;
-        friend base;
+        double seconds() const { return insertSeconds + deltaSeconds + writeSeconds; }
+        double objectsPerSecond() const { return seconds() > 0 ? double(objects) / seconds() : 0; }
+        double bytesPerSecond() const { return writeSeconds > 0 ? double(bytes) / writeSeconds : 0; }
     };
 
-    template <typename Iterator>
-    class Iterable {
+    // Builds a packfile with git_packbuilder and streams it to a sink as it
+    // is written, chunk by chunk, so the pack is never held in memory whole.
+    // Delta search runs on `threads` threads of libgit2's own.
+    class PackWriter {
     public:
-        using iterator = Iterator;
-        using git_iterator = typename iterator::git_iterator;
-        using next_f = typename iterator::next_f;
+        explicit PackWriter(UniquePtr<git_repository> & repo, unsigned int threads = std::thread::hardware_concurrency())
+        : pb_{repo[git_packbuilder_new]()} {
+            git_packbuilder_set_threads(&*pb_, threads ? threads : 1);
+        }
 
-        Iterable(next_f next) : next_(std::move(next)) { }
+        // One object. `name` (a path for blobs and trees) guides delta search.
+        void insert(git_oid const & id, char const * name = nullptr) {
+            timed([&] { check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert, &*pb_, &id, name)); });
+        }
 
-        Iterator begin() { return {static_cast<UniquePtr<git_iterator> *>(this), next_}; }
-        Iterator end() { return {}; }
+        // Objects from a range of git_oid or git_oid const *.
+        template <typename Range>
+        void insertAll(Range const & ids) {
+            timed([&] {
+                for (auto && id : ids) {
+                    check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert, &*pb_, &detail::oidOf(id), nullptr));
+                }
+            });
+        }
 
-    private:
-        next_f next_;
-    };
+        // A tree and everything under it.
+        void insertTree(git_oid const & id) {
+            timed([&] { check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert_tree, &*pb_, &id)); });
+        }
 
-    namespace detail {
+        // A commit and its tree.
+        void insertCommit(git_oid const & id) {
+            timed([&] { check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert_commit, &*pb_, &id)); });
+        }
 
-        using ConfigIterable = Iterable<Iterator<git_config_iterator, decltype(&git_config_next), git_config_entry, obj_no_free<git_config_entry>>>;
-        template <> class MaybeIterable<UniquePtr<git_config_iterator>> : public ConfigIterable {
-        public:
-            MaybeIterable() : ConfigIterable(git_config_next) {}
-        };
+        // Any object, and whatever it reaches through trees.
+        void insertRecursive(git_oid const & id, char const * name = nullptr) {
+            timed([&] { check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert_recur, &*pb_, &id, name)); });
+        }
 
-#if LIBGIT2PP_HAVE_INDEX_ITERATOR
-        using IndexIteratorIterable = Iterable<Iterator<git_index_iterator, decltype(&git_index_iterator_next), const git_index_entry>>;
-        template <> class MaybeIterable<UniquePtr<git_index_iterator>> : public IndexIteratorIterable {
-        public:
-            MaybeIterable() : IndexIteratorIterable(git_index_iterator_next) {}
-        };
-#endif
+        // Every commit the walk yields, with their trees, minus what hidden
+        // commits already reach.
+        void insertWalk(UniquePtr<git_revwalk> & walk) {
+            timed([&] { check(detail::call<detail::FailsIfNegative>(git_packbuilder_insert_walk, &*pb_, &*walk)); });
+        }
 
-        using ReferenceIterable = Iterable<Iterator<git_reference_iterator, decltype(&git_reference_next), git_reference>>;
-        template <> class MaybeIterable<UniquePtr<git_reference_iterator>> : public ReferenceIterable {
-        public:
-            MaybeIterable() : ReferenceIterable(git_reference_next) {}
-        };
+        size_t size() const { return git_packbuilder_object_count(&*pb_); }
 
-        using RebaseIterable = Iterable<StructIterator<git_rebase, decltype(&git_rebase_next), git_rebase_operation *>>;
-        template <> class MaybeIterable<UniquePtr<git_rebase>> : public RebaseIterable {
-        public:
-            MaybeIterable() : RebaseIterable(git_rebase_next) {}
-        };
+        // Writes the pack to `sink` (called with each chunk in order). An
+        // exception from the sink aborts the write and is rethrown.
+        PackStats write(std::function<void(char const *, size_t)> const & sink) {
+            struct Writer {
+                std::function<void(char const *, size_t)> const & sink;
+                PackStats & stats;
+                std::chrono::steady_clock::time_point start;
+                bool first = true;
+                std::exception_ptr error;
+                unsigned char tail[GIT_OID_RAWSZ] = {};     // The last bytes seen: the pack's checksum.
+            } w{sink, stats_, std::chrono::steady_clock::now()};
+            stats_.objects = size();
+            stats_.bytes = 0;
+            // Deltas are all found before the first chunk is handed over.
+            int rc = git_packbuilder_foreach(&*pb_, [](void * buf, size_t size, void * p) {
+                auto & w = *static_cast<Writer *>(p);
+                try {
+                    if (w.first) {
+                        auto now = std::chrono::steady_clock::now();
+                        w.stats.deltaSeconds = std::chrono::duration<double>(now - w.start).count();
+                        w.start = now;
+                        w.first = false;
+                    }
+                    w.sink(static_cast<char const *>(buf), size);
+                    w.stats.bytes += size;
+                    auto bytes = static_cast<unsigned char const *>(buf);
+                    if (size >= sizeof(w.tail)) {
+                        std::memcpy(w.tail, bytes + size - sizeof(w.tail), sizeof(w.tail));
+                    } else {
+                        std::memmove(w.tail, w.tail + size, sizeof(w.tail) - size);
+                        std::memcpy(w.tail + sizeof(w.tail) - size, bytes, size);
+                    }
+                    return 0;
+                } catch (...) {
+                    w.error = std::current_exception();
+                    return int(GIT_EUSER);
+                }
+            }, &w);
+            if (w.error) {
+                std::rethrow_exception(w.error);
+            }
+            check(rc);
+            git_oid_fromraw(&hash_, w.tail);
+            stats_.writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - w.start).count();
+            return stats_;
+        }
 
-        using RevwalkIterable = Iterable<StructIterator<git_revwalk, decltype(&git_revwalk_next), git_oid>>;
-        template <> class MaybeIterable<UniquePtr<git_revwalk>> : public RevwalkIterable {
-        public:
-            MaybeIterable() : RevwalkIterable(git_revwalk_next) {}
-        };
+        PackStats write(std::ostream & os) {
+            return write([&](char const * data, size_t size) {
+                if (!os.write(data, std::streamsize(size))) {
+                    throw Error{"PackWriter: stream write failed"};
+                }
+            });
+        }
 
-        using BranchIterable = Iterable<BranchIterator<git_branch_iterator, decltype(&git_branch_next)>>;
-        template <> class MaybeIterable<UniquePtr<git_branch_iterator>> : public BranchIterable {
-        public:
-            MaybeIterable() : BranchIterable(git_branch_next) {}
-        };
+#if !defined(_WIN32)
+        PackStats write(int fd) {
+            return write([&](char const * data, size_t size) {
+                if (!detail::writeAll(fd, data, size)) {
+                    throw Error{"PackWriter: write failed"};
+                }
+            });
+        }
+#endif
 
-        using IndexConflictIterable = Iterable<IndexConflictIterator<git_index_conflict_iterator, decltype(&git_index_conflict_next)>>;
-        template <> class MaybeIterable<UniquePtr<git_index_conflict_iterator>> : public IndexConflictIterable {
-        public:
-            MaybeIterable() : IndexConflictIterable(git_index_conflict_next) {}
-        };
+        // The pack's trailing checksum, which names it (pack-<hash>.pack);
+        // valid after write(). (git_packbuilder_hash is only set when libgit2
+        // writes the pack to disk itself.)
+        git_oid const & hash() const { return hash_; }
 
-        using NoteIterable = Iterable<NoteIterator<git_note_iterator, decltype(&git_note_next)>>;
-        template <> class MaybeIterable<UniquePtr<git_note_iterator>> : public NoteIterable {
-        public:
-            MaybeIterable() : NoteIterable(git_note_next) {}
-        };
+        PackStats const & stats() const { return stats_; }
 
-    }
+    private:
+        UniquePtr<git_packbuilder> pb_;
+        PackStats stats_;
+        git_oid hash_{};
+
+        template <typename F>
+        void timed(F && f) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            stats_.insertSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    };
 
 }
 